@@ -25,11 +25,13 @@ import java.io.File;
 import java.io.FileOutputStream;
 import java.io.IOException;
 import java.net.Socket;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.security.NoSuchAlgorithmException;
 import java.util.Arrays;
 import java.util.concurrent.BlockingQueue;
 import java.util.concurrent.LinkedBlockingQueue;
-import java.util.concurrent.TimeUnit;
+import java.util.zip.CRC32;
 
 import pwi.phloppy_0.Message.Command;
 
@@ -86,6 +88,18 @@ class Emulator extends Thread {
     private static final byte OP_TYPE1_RAW = 0x20;
     private static final byte OP_TYPE2_RAW = 0x21;
     private static final byte OP_TYPE3_RAW = 0x22;
+    private static final byte OP_ACK = 0x28;
+    private static final byte OP_RESYNC = 0x29;
+    private static final byte OP_BULK = 0x2b;
+    private static final byte OP_UPLOAD = 0x2c;
+
+    private static final int INFO_FRAME = 0x10;
+    private static final int INFO_BULK_ERROR = 0x04;
+
+    private static final int SECTOR_FRAME = 0x40;
+    private static final int SECTOR_SIZE = 512;
+    // One cylinder of an ADF image
+    private static final int BULK_CHUNK = 2 * 11 * 512;
 
     private static final int ROOTBLOCK_OFFSET = 0x6e000;
     private static final int ROOTBLOCK_CKSUM_OFFSET = 0x6e014;
@@ -134,7 +148,13 @@ class Emulator extends Thread {
         IDLE,
         DRVNO,
         TT,
-        TRANSMIT
+        GEN,
+        MASK_LO,
+        MASK_HI,
+        TRANSMIT,
+        INFO_ID,
+        INFO_LENGTH,
+        INFO
     }
 
     private Callback callback;
@@ -142,27 +162,33 @@ class Emulator extends Thread {
     private int port;
 
     private Socket mainSocket;
+    private Socket dataSocket;
+    private Uploader uploader;
     private BlockingQueue<Message> messages = new LinkedBlockingQueue<>();
     private Receiver receiver;
     private RxState rxState = RxState.IDLE;
     private FloppyImage[] images = {null, null, null, null};
     private boolean[] writeProtection = {true, true, true, true};
-    private byte[] padding;
+    // OP_UPLOAD serials, the device uses them to tell uploads and cancels apart
+    // whatever order the main and data connections deliver them in
+    private byte[] uploadSerials = new byte[4];
 
     private int rxDrvno;
+    private boolean rxSectorFrame;
+    private int rxTt;
+    private int rxGen;
+    private int rxSectors;
     private int rxOffset;
+    private int rxLength;
     private int rxCount;
     private byte[] rxTrack = new byte[16384];
+    private int rxInfoId;
     private boolean slipEscaping = false;
 
     public Emulator(String host, int port, Callback callback) {
         this.host = host;
         this.port = port;
         this.callback = callback;
-
-        padding = new byte[65];
-        padding[0] = END;
-        padding[1] = OP_NOP;
     }
 
     public void close() {
@@ -205,6 +231,11 @@ class Emulator extends Thread {
             Log.d(TAG, "Connected to " + host + ":" + port);
             receiver = new Receiver(mainSocket, messages);
             receiver.start();
+            // Image uploads, see Uploader
+            dataSocket = new Socket(host, port + 2);
+            Log.d(TAG, "Connected to " + host + ":" + (port + 2));
+            uploader = new Uploader(dataSocket, messages);
+            uploader.start();
             callback.onEmulatorConnected(true, null);
         } catch (IOException e) {
             callback.onEmulatorConnected(false, e.getMessage());
@@ -213,47 +244,40 @@ class Emulator extends Thread {
 
         while (true) {
             try {
-                Message message;
-                if (rxState != RxState.IDLE) {
-                    message = messages.poll();
-                } else {
-                    message = messages.poll(250, TimeUnit.MILLISECONDS);
-                }
-                if (message == null) {
-                    // Force rx
-                    if (rxState != RxState.IDLE) {
-                        send(new byte[]{END, OP_NOP}, new byte[4096 - 2]);
-                    } else {
-                        send(new byte[]{END, OP_NOP});
-                    }
-                } else {
-                    Log.d(TAG, message.toString());
-                    switch (message.command) {
-                        case INSERT:
-                            closeImage(message.drvno);
-                            openImage(message.drvno, new String(message.data));
-                            break;
-
-                        case EJECT:
-                            sendEject(message.drvno);
-                            closeImage(message.drvno);
-                            break;
-
-                        case WRITE_PROTECT:
-                            writeProtection[message.drvno] = true;
-                            sendWriteProtect(message.drvno);
-                            break;
-
-                        case WRITE_UNPROTECT:
-                            writeProtection[message.drvno] = false;
-                            sendWriteProtect(message.drvno);
-                            break;
-
-                        case RX:
-                            processRX(message.data);
-                            Log.d(TAG, "Total rx bytes: " + rxCount + ", state: " + rxState);
-                            break;
-                    }
+                // Written tracks are pushed by the device
+                Message message = messages.take();
+                Log.d(TAG, message.toString());
+                switch (message.command) {
+                    case INSERT:
+                        closeImage(message.drvno);
+                        openImage(message.drvno, new String(message.data));
+                        break;
+
+                    case EJECT:
+                        sendEject(message.drvno);
+                        closeImage(message.drvno);
+                        break;
+
+                    case WRITE_PROTECT:
+                        writeProtection[message.drvno] = true;
+                        sendWriteProtect(message.drvno);
+                        break;
+
+                    case WRITE_UNPROTECT:
+                        writeProtection[message.drvno] = false;
+                        sendWriteProtect(message.drvno);
+                        sendResync(message.drvno);
+                        break;
+
+                    case UPLOADED:
+                        setRemoteId(message.drvno, message.data);
+                        callback.onImageLoaded(message.drvno, true, null);
+                        break;
+
+                    case RX:
+                        processRX(message.data);
+                        Log.d(TAG, "Total rx bytes: " + rxCount + ", state: " + rxState);
+                        break;
                 }
             } catch (InterruptedException e) {
                 Log.d(TAG, e.getMessage(), e);
@@ -266,8 +290,10 @@ class Emulator extends Thread {
         Log.d(TAG, "Closing connections");
 
         receiver.close();
+        uploader.close();
         try {
             mainSocket.close();
+            dataSocket.close();
         } catch (IOException e) {
         }
 
@@ -311,35 +337,38 @@ class Emulator extends Thread {
 
     private void openImage(int drvno, String path) {
         try {
-            long t0 = System.currentTimeMillis();
             FloppyImage img = images[drvno] = new FloppyImage(path);
             byte[] remoteId = getRemoteId(drvno);
             if (!Arrays.equals(img.id(), remoteId)) {
                 Log.d(TAG, "Sending drive " + drvno + " data");
                 if (drvno == 0) {
                     byte type = img.raw() ? OP_TYPE0_RAW : OP_TYPE0_ADF;
-                    send(new byte[]{END, OP_EJECT0, END, type, END, OP_FILL0}, slipEncode(img.data()), new byte[]{END, OP_INSERT0});
-                    setRemoteId(drvno, img.id());
+                    sendEject(0);
+                    send(type);
+                    sendImage(0, OP_INSERT0);
                 } else if (drvno == 1) {
                     byte type = img.raw() ? OP_TYPE1_RAW : OP_TYPE1_ADF;
-                    send(new byte[]{END, OP_EJECT1, END, type, END, OP_FILL1}, slipEncode(img.data()), new byte[]{END, OP_INSERT1});
-                    setRemoteId(drvno, img.id());
+                    sendEject(1);
+                    send(type);
+                    sendImage(1, OP_INSERT1);
                 } else if (drvno == 2) {
                     byte type = img.raw() ? OP_TYPE2_RAW : OP_TYPE2_ADF;
-                    send(new byte[]{END, OP_EJECT2, END, type, END, OP_FILL2}, slipEncode(img.data()), new byte[]{END, OP_INSERT2});
-                    setRemoteId(drvno, img.id());
+                    sendEject(2);
+                    send(type);
+                    sendImage(2, OP_INSERT2);
                 } else if (drvno == 3) {
                     byte type = img.raw() ? OP_TYPE3_RAW : OP_TYPE3_ADF;
-                    send(new byte[]{END, OP_EJECT3, END, type, END, OP_FILL3}, slipEncode(img.data()), new byte[]{END, OP_INSERT3});
-                    setRemoteId(drvno, img.id());
+                    sendEject(3);
+                    send(type);
+                    sendImage(3, OP_INSERT3);
                 }
-                long t1 = System.currentTimeMillis();
-                Log.d(TAG, "Elapsed time: " + (t1 - t0) + " ms");
+                // Loaded once UPLOADED comes back from the uploader
             } else {
                 Log.d(TAG, "Skip sending drive " + drvno + " data");
+                // Already in the device, maybe with writes a previous connection lost
+                sendResync(drvno);
+                callback.onImageLoaded(drvno, true, null);
             }
-
-            callback.onImageLoaded(drvno, true, null);
         } catch (Exception e) {
             callback.onImageLoaded(drvno, false, e.getMessage());
         }
@@ -356,23 +385,30 @@ class Emulator extends Thread {
         }
     }
 
+    // Ejects the drive and cancels its upload, including what is already on the data connection
     private void sendEject(int drvno) throws IOException {
-        if (drvno == 0) {
-            setRemoteId(drvno, new byte[20]);
-            send(OP_EJECT0);
-        } else if (drvno == 1) {
-            setRemoteId(drvno, new byte[20]);
-            send(OP_EJECT1);
-        } else if (drvno == 2) {
-            setRemoteId(drvno, new byte[20]);
-            send(OP_EJECT2);
-        } else if (drvno == 3) {
-            setRemoteId(drvno, new byte[20]);
-            send(OP_EJECT3);
-        }
+        uploader.cancel(drvno);
+        setRemoteId(drvno, new byte[20]);
+        uploadSerials[drvno]++;
+        send(uploadOp(drvno));
         Log.d(TAG, "Send IDs (2)");
     }
 
+    private byte[] uploadOp(int drvno) {
+        byte[] encoded = slipEncode(new byte[]{(byte) drvno, uploadSerials[drvno]});
+        ByteBuffer frame = ByteBuffer.allocate(2 + encoded.length);
+        frame.put(END).put(OP_UPLOAD).put(encoded);
+        return frame.array();
+    }
+
+    // Asks the device for the drive's writes which were never acknowledged,
+    // e.g. because a previous connection was lost. Only once they can be stored.
+    private void sendResync(int drvno) throws IOException {
+        if (images[drvno] != null && !writeProtection[drvno]) {
+            send(new byte[]{END, OP_RESYNC}, slipEncode(new byte[]{(byte) drvno}));
+        }
+    }
+
     private void sendWriteProtect(int drvno) throws IOException {
         if (drvno == 0) {
             if (writeProtection[drvno]) {
@@ -406,17 +442,8 @@ class Emulator extends Thread {
     }
 
     private void send(byte[]... data) throws IOException {
-        int total = 0;
         for (byte[] d : data) {
             mainSocket.getOutputStream().write(d);
-            total += d.length;
-        }
-
-        int length = 64 - total % 64;
-        if (length == 1) {
-            mainSocket.getOutputStream().write(padding, 0, 65);
-        } else if (length > 0) {
-            mainSocket.getOutputStream().write(padding, 0, length);
         }
     }
 
@@ -434,10 +461,14 @@ class Emulator extends Thread {
                 } else if (d == RX_END || d == RX_ERROR) {
                     rxState = RxState.IDLE;
                     Log.d(TAG, "Exit DRVNO: byte=" + d + ", cnt=" + rxCount);
+                } else if (d == INFO_FRAME) {
+                    rxState = RxState.INFO_ID;
                 } else {
                     rxState = RxState.TT;
-                    rxDrvno = d;
-                    if (writeProtection[rxDrvno]) {
+                    rxSectorFrame = (d & SECTOR_FRAME) != 0;
+                    rxDrvno = d & ~SECTOR_FRAME;
+                    if (writeProtection[rxDrvno] || images[rxDrvno] == null) {
+                        // Not acknowledged, sent again after sendResync()
                         rxState = RxState.IDLE;
                     }
                 }
@@ -447,11 +478,82 @@ class Emulator extends Thread {
                 } else if (d == RX_END || d == RX_ERROR) {
                     rxState = RxState.IDLE;
                     Log.d(TAG, "Exit TT: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxState = RxState.GEN;
+                    rxTt = d;
+                }
+            } else if (rxState == RxState.GEN) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit GEN: byte=" + d + ", cnt=" + rxCount);
+                } else if (rxSectorFrame) {
+                    rxState = RxState.MASK_LO;
+                    rxGen = d;
                 } else {
                     rxState = RxState.TRANSMIT;
-                    rxOffset = d * images[rxDrvno].bytesPerTrack();
+                    rxGen = d;
+                    rxSectors = 0;
+                    rxOffset = rxTt * images[rxDrvno].bytesPerTrack();
+                    rxLength = images[rxDrvno].bytesPerTrack();
+                    rxCount = 0;
+                }
+            } else if (rxState == RxState.MASK_LO) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit MASK_LO: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxState = RxState.MASK_HI;
+                    rxSectors = d;
+                }
+            } else if (rxState == RxState.MASK_HI) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit MASK_HI: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxSectors |= d << 8;
+                    nextSector();
+                }
+            } else if (rxState == RxState.INFO_ID) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit INFO_ID: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxState = RxState.INFO_LENGTH;
+                    rxInfoId = d;
+                }
+            } else if (rxState == RxState.INFO_LENGTH) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit INFO_LENGTH: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxState = d > 0 ? RxState.INFO : RxState.IDLE;
+                    rxLength = d;
                     rxCount = 0;
                 }
+            } else if (rxState == RxState.INFO) {
+                if (d == RX_ESC) {
+                    // pass
+                } else if (d == RX_END || d == RX_ERROR) {
+                    rxState = RxState.IDLE;
+                    Log.d(TAG, "Exit INFO: byte=" + d + ", cnt=" + rxCount);
+                } else {
+                    rxTrack[rxCount++] = (byte) d;
+                    if (rxCount == rxLength) {
+                        rxCount = 0;
+                        rxState = RxState.IDLE;
+                        processInfo();
+                    }
+                }
             } else if (rxState == RxState.TRANSMIT) {
                 if (d == RX_ESC) {
                     // pass
@@ -461,15 +563,21 @@ class Emulator extends Thread {
                 } else {
                     rxTrack[rxCount++] = (byte) d;
                     if (images[rxDrvno] != null) {
-                        if (rxCount == images[rxDrvno].bytesPerTrack()) {
+                        if (rxCount == rxLength) {
                             rxCount = 0;
                             rxState = RxState.IDLE;
                             try {
-                                images[rxDrvno].write(rxTrack, rxOffset);
-                                callback.onTrackWritten(rxDrvno, rxOffset / images[rxDrvno].bytesPerTrack());
+                                images[rxDrvno].write(rxTrack, rxOffset, rxLength);
+                                if (rxSectors == 0) {
+                                    sendAck();
+                                    callback.onTrackWritten(rxDrvno, rxTt);
+                                }
                             } catch (IOException e) {
                                 callback.onWriteError(rxDrvno, e.getMessage());
                             }
+                            if (rxSectors != 0) {
+                                nextSector();
+                            }
                         }
                     } else {
                         rxState = RxState.IDLE;
@@ -479,13 +587,81 @@ class Emulator extends Thread {
         }
     }
 
+    private void processInfo() {
+        if (rxInfoId == INFO_BULK_ERROR) {
+            ByteBuffer info = ByteBuffer.wrap(rxTrack, 0, rxLength).order(ByteOrder.LITTLE_ENDIAN);
+            int offset = info.getInt();
+            int length = info.getInt();
+            int drvno = info.get();
+            int error = info.get();
+            Log.d(TAG, "Bulk error " + error + ", drive " + drvno + ": " + offset + ".." + (offset + length));
+            if (drvno >= 0 && drvno < 4 && images[drvno] != null) {
+                try {
+                    uploader.put(drvno, bulk(drvno, offset, length));
+                } catch (IOException e) {
+                    Log.d(TAG, e.getMessage(), e);
+                }
+            }
+        }
+    }
+
+    // The device inserts the image once all of it has arrived over the data connection
+    private void sendImage(int drvno, byte insert) throws IOException {
+        int size = images[drvno].bytesPerTrack() * FloppyImage.TRACKS_PER_DISK;
+        uploader.put(drvno, uploadOp(drvno));
+        for (int offset = 0; offset < size; offset += BULK_CHUNK) {
+            uploader.put(drvno, bulk(drvno, offset, BULK_CHUNK));
+        }
+        uploader.put(drvno, new byte[]{END, insert});
+        uploader.done(drvno, images[drvno].id());
+    }
+
+    // Image data with a CRC, sent without SLIP encoding
+    private byte[] bulk(int drvno, int offset, int length) throws IOException {
+        byte[] data = images[drvno].read(offset, length);
+        CRC32 crc = new CRC32();
+        crc.update(data);
+        ByteBuffer header = ByteBuffer.allocate(13).order(ByteOrder.LITTLE_ENDIAN);
+        header.put((byte) drvno).putInt(offset).putInt(data.length).putInt((int) crc.getValue());
+        byte[] encoded = slipEncode(header.array());
+        ByteBuffer frame = ByteBuffer.allocate(2 + encoded.length + data.length);
+        frame.put(END).put(OP_BULK).put(encoded).put(data);
+        return frame.array();
+    }
+
+    // Track complete, the device may forget it. The id first, so that a later
+    // connection knows the device's image is the same as the file.
+    private void sendAck() {
+        try {
+            setRemoteId(rxDrvno, images[rxDrvno].updateId());
+            send(new byte[]{END, OP_ACK}, slipEncode(new byte[]{(byte) rxDrvno, (byte) rxTt, (byte) rxGen}));
+        } catch (IOException e) {
+            Log.d(TAG, e.getMessage(), e);
+        }
+    }
+
+    private void nextSector() {
+        if (rxSectors == 0 || images[rxDrvno] == null) {
+            rxState = RxState.IDLE;
+            return;
+        }
+        int sector = Integer.numberOfTrailingZeros(rxSectors);
+        rxSectors &= rxSectors - 1;
+        rxState = RxState.TRANSMIT;
+        rxOffset = rxTt * images[rxDrvno].bytesPerTrack() + sector * SECTOR_SIZE;
+        rxLength = SECTOR_SIZE;
+        rxCount = 0;
+    }
+
     private int slipDecode(byte b) {
         if (slipEscaping) {
             slipEscaping = false;
+            // Unsigned like any other byte, the sector mask, tt and generation
+            // may be escaped too
             if (b == ESC_END) {
-                return END;
+                return 0xff & END;
             } else if (b == ESC_ESC) {
-                return ESC;
+                return 0xff & ESC;
             } else {
                 return RX_ERROR;
             }
@@ -63,6 +63,16 @@ public class FloppyImage {
         return Arrays.copyOf(id, id.length);
     }
 
+    // The id follows the file once written tracks are stored
+    byte[] updateId() throws IOException {
+        try {
+            id = MessageDigest.getInstance("SHA1").digest(data());
+        } catch (NoSuchAlgorithmException e) {
+            throw new IOException(e);
+        }
+        return id();
+    }
+
     boolean raw() {
         return this.raw;
     }
@@ -78,13 +88,23 @@ public class FloppyImage {
         return b;
     }
 
+    byte[] read(int offset, int length) throws IOException {
+        byte b[] = new byte[(int) Math.max(0, Math.min(length, file.length() - offset))];
+        file.seek(offset);
+        file.readFully(b);
+        return b;
+    }
+
     void close() throws IOException {
         Log.d(TAG, "Closing " + path);
         file.close();
     }
 
     void write(byte[] b, int offset) throws IOException {
-        int length = bytesPerTrack();
+        write(b, offset, bytesPerTrack());
+    }
+
+    void write(byte[] b, int offset, int length) throws IOException {
         Log.d(TAG, "Writing " + path + ": " + offset + ".." + (offset + length));
         file.seek(offset);
         file.write(b, 0, length);
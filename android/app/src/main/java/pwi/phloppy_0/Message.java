@@ -25,7 +25,9 @@ class Message {
         EJECT,
         WRITE_PROTECT,
         WRITE_UNPROTECT,
-        RX
+        RX,
+        UPLOAD,
+        UPLOADED
     }
 
     Command command;
@@ -0,0 +1,81 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+package pwi.phloppy_0;
+
+import java.io.IOException;
+import java.net.Socket;
+import java.util.Iterator;
+import java.util.Queue;
+import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.LinkedBlockingQueue;
+
+// Sends image uploads over the data connection, so that they don't hold up
+// the ops on the main connection
+class Uploader extends Thread {
+    private Socket socket;
+    private Queue<Message> messages;
+    private BlockingQueue<Message> uploads = new LinkedBlockingQueue<>();
+
+    Uploader(Socket socket, Queue<Message> messages) {
+        this.socket = socket;
+        this.messages = messages;
+    }
+
+    void close() {
+        interrupt();
+    }
+
+    void put(int drvno, byte[] data) {
+        uploads.offer(new Message(Message.Command.UPLOAD, drvno, data));
+    }
+
+    // Passes UPLOADED with the image id to the emulator once everything before it was sent
+    void done(int drvno, byte[] id) {
+        uploads.offer(new Message(Message.Command.UPLOADED, drvno, id));
+    }
+
+    // Drops the drive's queued uploads, the device drops what is already on its way
+    // after OP_UPLOAD with a newer serial on the main connection
+    void cancel(int drvno) {
+        Iterator<Message> i = uploads.iterator();
+        while (i.hasNext()) {
+            if (i.next().drvno == drvno) {
+                i.remove();
+            }
+        }
+    }
+
+    @Override
+    public void run() {
+        while (true) {
+            try {
+                Message message = uploads.take();
+                if (message.command == Message.Command.UPLOAD) {
+                    socket.getOutputStream().write(message.data);
+                } else {
+                    messages.offer(message);
+                }
+            } catch (InterruptedException e) {
+                break;
+            } catch (IOException e) {
+                break;
+            }
+        }
+    }
+}
@@ -2,12 +2,15 @@
 
 import argparse
 import datetime
+import hashlib
 import mmap
 import Queue
 import socket
+import struct
 import sys
 import threading
 import time
+import zlib
 
 END = "\xc0"
 ESC = "\xdb"
@@ -35,11 +38,38 @@ OP_WPROT2   = "\x17"
 OP_WPROT3   = "\x18"
 OP_WUNPROT2 = "\x19"
 OP_WUNPROT3 = "\x1a"
+OP_DELAY0   = "\x23"
+OP_DELAY1   = "\x24"
+OP_DELAY2   = "\x25"
+OP_DELAY3   = "\x26"
+OP_GET_STATS = "\x27"
+OP_ACK      = "\x28"
+OP_RESYNC   = "\x29"
+OP_POLICY   = "\x2a"
+OP_BULK     = "\x2b"
+OP_UPLOAD   = "\x2c"
+
+POLICIES = ["round-robin", "oldest", "selected-last"]
+
+INFO_FRAME       = 0x10
+INFO_CACHE_STATS = 0x01
+INFO_WRITE_BACK_STATS = 0x02
+INFO_FLUX_HISTOGRAM = 0x03
+INFO_BULK_ERROR  = 0x04
+SECTOR_FRAME     = 0x40
+
+# [byte] one cylinder of an ADF image
+BULK_CHUNK = 2*11*512
+# SHA-1 of the image in a drive, kept by the ESP8266 across host connections
+ID_SIZE = 20
+NO_ID = "\0" * ID_SIZE
 
 
 class Emulator(threading.Thread):
-    def __init__(self, address, port):
+    def __init__(self, address, port, data_port, aux_port):
         threading.Thread.__init__(self)
+        self.address = address
+        self.aux_port = aux_port
         self.path = ["", "", "", ""]
         self.file = [None, None, None, None]
         self.image = [None, None, None, None]
@@ -47,8 +77,17 @@ class Emulator(threading.Thread):
         self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1048576)
         self.sock.connect((address, port))
+        # Image uploads go to a connection of their own so that ops on the
+        # main one take effect right away
+        self.data_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.data_sock.connect((address, data_port))
+        self.uploads = Queue.Queue()
+        self.upload_serial = [0, 0, 0, 0]
+        self.upload_thread = threading.Thread(target=self.upload_loop)
+        self.upload_thread.start()
         self.mq1 = Queue.Queue()
         self.mq2 = Queue.Queue()
+        self.mq3 = Queue.Queue()
         self.rx_state = "IDLE"
         self.escaping = False
         self.rx_thread = threading.Thread(target=self.rx_loop)
@@ -69,17 +108,30 @@ class Emulator(threading.Thread):
         self.mq1.put(("WPROT", (drvno, flag)))
         return self.mq2.get()
 
+    def read_delay(self, drvno, delay):
+        self.mq1.put(("DELAY", (drvno, delay)))
+        return self.mq2.get()
+
+    def stats(self):
+        self.mq1.put(("STATS", None))
+        try:
+            return "\n".join([self.mq3.get(True, 2) for i in range(3)])
+        except Queue.Empty:
+            return None
+
+    def policy(self, policy):
+        self.mq1.put(("POLICY", policy))
+        return self.mq2.get()
+
     def run(self):
         while True:
-            try:
-                if self.rx_state != "IDLE":
-                    c, args = self.mq1.get_nowait()
-                else:
-                    c, args = self.mq1.get(True, 0.5)
-            except Queue.Empty:
-                c, args = "TIMEOUT", None
+            # Written tracks are pushed by the device
+            c, args = self.mq1.get()
 
             if c == "EXIT":
+                self.uploads.put(None)
+                self.upload_thread.join()
+                self.data_sock.close()
                 self.sock.shutdown(socket.SHUT_RDWR)
                 self.sock.close()
                 self.close_image(0)
@@ -92,22 +144,27 @@ class Emulator(threading.Thread):
                 try:
                     self.close_image(drvno)
                     self.open_image(drvno, path)
-                    data = self.file[drvno].read()
-                    if drvno == 0:
-                        self.send(END, OP_EJECT0, END, OP_FILL0, self.slip_encode(data), END, OP_INSERT0)
-                    elif drvno == 1:
-                        self.send(END, OP_EJECT1, END, OP_FILL1, self.slip_encode(data), END, OP_INSERT1)
-                    elif drvno == 2:
-                        self.send(END, OP_EJECT2, END, OP_FILL2, self.slip_encode(data), END, OP_INSERT2)
+                    if self.image_id(drvno) == self.get_remote_id(drvno):
+                        # Already in the device, maybe with writes a previous
+                        # connection lost
+                        self.resync(drvno)
                     else:
-                        self.send(END, OP_EJECT3, END, OP_FILL3, self.slip_encode(data), END, OP_INSERT3)
+                        # The device inserts the image once all of it has arrived
+                        self.cancel_upload(drvno)
+                        serial = self.upload_serial[drvno]
+                        self.uploads.put((drvno, serial, OP_UPLOAD + self.slip_encode(chr(drvno) + chr(serial))))
+                        for offset in range(0, len(self.image[drvno]), BULK_CHUNK):
+                            self.uploads.put((drvno, serial, (offset, BULK_CHUNK)))
+                        self.uploads.put((drvno, serial, [OP_INSERT0, OP_INSERT1, OP_INSERT2, OP_INSERT3][drvno]))
+                        self.uploads.put((drvno, serial, None))
                     self.mq2.put("")
                 except Exception, msg:
                     self.path[drvno] = ""
                     self.mq2.put(msg)
             elif c == "EJECT":
+                drvno = args
+                self.cancel_upload(drvno)
                 self.close_image(drvno)
-                self.send(END, [OP_EJECT0, OP_EJECT1, OP_EJECT2, OP_EJECT3][drvno])
                 self.mq2.put("")
             elif c == "WPROT":
                 drvno, flag = args
@@ -116,12 +173,21 @@ class Emulator(threading.Thread):
                     self.send(END, [OP_WPROT0, OP_WPROT1, OP_WPROT2, OP_WPROT3][drvno])
                 else:
                     self.send(END, [OP_WUNPROT0, OP_WUNPROT1, OP_WUNPROT2, OP_WUNPROT3][drvno])
+                    self.resync(drvno)
                 self.mq2.put("")
-            elif c == "TIMEOUT":
-                if self.rx_state != "IDLE":
-                    self.send(END, OP_NOP, "\x00" * (4096-2))
-                else:
-                    self.send(END, OP_NOP)
+            elif c == "DELAY":
+                drvno, delay = args
+                self.send(END, [OP_DELAY0, OP_DELAY1, OP_DELAY2, OP_DELAY3][drvno], self.slip_encode(chr(delay)))
+                self.mq2.put("")
+            elif c == "STATS":
+                self.send(END, OP_GET_STATS)
+            elif c == "POLICY":
+                self.send(END, OP_POLICY, chr(args))
+                self.mq2.put("")
+            elif c == "UPLOADED":
+                drvno, serial = args
+                if serial == self.upload_serial[drvno] and self.path[drvno]:
+                    self.set_remote_id(drvno, self.image_id(drvno))
             elif c == "RX":
                 self.process_rx(args)
 
@@ -137,16 +203,74 @@ class Emulator(threading.Thread):
             self.file[drvno].close()
 
     def send(self, *args):
-        chunk_size = 64
-        data = "".join(args)
-        tail_length = chunk_size - (len(data) % chunk_size)
-        if tail_length == 1:
-            padding = "".join([END, OP_NOP, "\x00" * 63])
-        elif tail_length:
-            padding = "".join([END, OP_NOP, "\x00" * tail_length])
-        else:
-            padding = ""
-        self.sock.sendall("".join([data, padding]))
+        self.sock.sendall("".join(args))
+
+    def image_id(self, drvno):
+        return hashlib.sha1(self.image[drvno][:]).digest()
+
+    def read_remote_ids(self, sock):
+        data = ""
+        while len(data) < 4 * ID_SIZE:
+            chunk = sock.recv(4 * ID_SIZE - len(data))
+            if not chunk:
+                raise socket.error("aux connection closed")
+            data += chunk
+        return [data[i*ID_SIZE:(i+1)*ID_SIZE] for i in range(4)]
+
+    def get_remote_id(self, drvno):
+        try:
+            sock = socket.create_connection((self.address, self.aux_port))
+            try:
+                return self.read_remote_ids(sock)[drvno]
+            finally:
+                sock.close()
+        except socket.error:
+            return None
+
+    def set_remote_id(self, drvno, image_id):
+        try:
+            sock = socket.create_connection((self.address, self.aux_port))
+            try:
+                ids = self.read_remote_ids(sock)
+                ids[drvno] = image_id
+                sock.sendall("".join(ids))
+            finally:
+                sock.close()
+        except socket.error:
+            sys.stderr.write("[A]"); sys.stderr.flush()
+
+    # Asks the device for the drive's writes which were never acknowledged,
+    # e.g. because a previous connection was lost. Only once they can be stored.
+    def resync(self, drvno):
+        if self.path[drvno] and not self.write_protection[drvno]:
+            self.send(END, OP_RESYNC, self.slip_encode(chr(drvno)))
+
+    def cancel_upload(self, drvno):
+        # Upload data still on its way is dropped by the device after this.
+        # The device compares serials, not arrival order: this may overtake
+        # the old upload on the data connection or be overtaken by the new one.
+        self.upload_serial[drvno] = (self.upload_serial[drvno] + 1) & 0xff
+        self.send(END, OP_UPLOAD, self.slip_encode(chr(drvno) + chr(self.upload_serial[drvno])))
+        self.set_remote_id(drvno, NO_ID)
+
+    def upload_loop(self):
+        while True:
+            job = self.uploads.get()
+            if job is None:
+                break
+            drvno, serial, data = job
+            if serial != self.upload_serial[drvno]:
+                continue
+            try:
+                if data is None:
+                    self.mq1.put(("UPLOADED", (drvno, serial)))
+                elif isinstance(data, tuple):
+                    self.data_sock.sendall(self.bulk(drvno, *data))
+                else:
+                    self.data_sock.sendall(END + data)
+            except (socket.error, ValueError):
+                # Image closed meanwhile
+                pass
 
     def rx_loop(self):
         while True:
@@ -169,21 +293,88 @@ class Emulator(threading.Thread):
                 elif d == "end" or d == "error":
                     self.rx_state = "IDLE"
                     sys.stderr.write("[E0]"); sys.stderr.flush()
+                elif ord(d) == INFO_FRAME:
+                    self.rx_state = "INFO_ID"
                 else:
                     self.rx_state = "TT"
-                    self.rx_drvno = ord(d)
-                    if self.write_protection[self.rx_drvno]:
+                    self.rx_sector_frame = (ord(d) & SECTOR_FRAME) != 0
+                    self.rx_drvno = ord(d) & ~SECTOR_FRAME
+                    if self.write_protection[self.rx_drvno] or not self.path[self.rx_drvno]:
+                        # Not acknowledged, sent again after resync()
+                        self.rx_state = "IDLE"
+            elif self.rx_state == "INFO_ID":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E3]"); sys.stderr.flush()
+                else:
+                    self.rx_state = "INFO_LENGTH"
+                    self.rx_info_id = ord(d)
+            elif self.rx_state == "INFO_LENGTH":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E3]"); sys.stderr.flush()
+                else:
+                    self.rx_state = "INFO"
+                    self.rx_info_length = ord(d)
+                    self.rx_info = []
+            elif self.rx_state == "INFO":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E3]"); sys.stderr.flush()
+                else:
+                    self.rx_info.append(d)
+                    if len(self.rx_info) == self.rx_info_length:
                         self.rx_state = "IDLE"
+                        self.process_info(self.rx_info_id, "".join(self.rx_info))
             elif self.rx_state == "TT":
                 if d == "esc":
                     pass
                 elif d == "end" or d == "error":
                     self.rx_state = "IDLE"
                     sys.stderr.write("[E1]"); sys.stderr.flush()
+                else:
+                    self.rx_state = "GEN"
+                    self.rx_tt = ord(d)
+            elif self.rx_state == "GEN":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E1]"); sys.stderr.flush()
+                elif self.rx_sector_frame:
+                    self.rx_state = "MASK_LO"
+                    self.rx_gen = ord(d)
                 else:
                     self.rx_state = "TRANSMIT"
-                    self.rx_offset = ord(d) * 512*11
+                    self.rx_gen = ord(d)
+                    self.rx_sectors = []
+                    self.rx_offset = self.rx_tt * 512*11
                     self.rx_end = self.rx_offset + 512*11
+            elif self.rx_state == "MASK_LO":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E1]"); sys.stderr.flush()
+                else:
+                    self.rx_state = "MASK_HI"
+                    self.rx_mask = ord(d)
+            elif self.rx_state == "MASK_HI":
+                if d == "esc":
+                    pass
+                elif d == "end" or d == "error":
+                    self.rx_state = "IDLE"
+                    sys.stderr.write("[E1]"); sys.stderr.flush()
+                else:
+                    self.rx_mask |= ord(d) << 8
+                    self.rx_sectors = [s for s in range(11) if self.rx_mask & (1 << s)]
+                    self.next_sector()
             elif self.rx_state == "TRANSMIT":
                 if d == "esc":
                     pass
@@ -194,7 +385,39 @@ class Emulator(threading.Thread):
                     self.image[self.rx_drvno][self.rx_offset] = d
                     self.rx_offset += 1
                     if self.rx_offset == self.rx_end:
-                        self.rx_state = "IDLE"
+                        self.next_sector()
+
+    def next_sector(self):
+        if self.rx_sectors:
+            self.rx_state = "TRANSMIT"
+            self.rx_offset = self.rx_tt * 512*11 + self.rx_sectors.pop(0) * 512
+            self.rx_end = self.rx_offset + 512
+        else:
+            # Track complete, the device may forget it. The id first, so that
+            # a later connection knows the device's image is the same as the file.
+            self.rx_state = "IDLE"
+            self.image[self.rx_drvno].flush()
+            self.set_remote_id(self.rx_drvno, self.image_id(self.rx_drvno))
+            self.send(END, OP_ACK, self.slip_encode(chr(self.rx_drvno) + chr(self.rx_tt) + chr(self.rx_gen)))
+
+    def process_info(self, info_id, data):
+        if info_id == INFO_CACHE_STATS:
+            values = struct.unpack("<8I", data)
+            self.mq3.put("\n".join(["drive %d: track cache hits = %d, misses = %d" % (drvno, values[drvno*2], values[drvno*2+1]) for drvno in range(4)]))
+        elif info_id == INFO_WRITE_BACK_STATS:
+            values = struct.unpack("<24I", data)
+            self.mq3.put("\n".join(["drive %d: dirty tracks = %d, oldest = %d ms, sent tracks = %d, header errors = %d, data errors = %d, lost tracks = %d" % ((drvno,) + values[drvno*6:drvno*6+6]) for drvno in range(4)]))
+        elif info_id == INFO_FLUX_HISTOGRAM:
+            values = struct.unpack("<65H", data)
+            # 200 ns bins, the last one collects everything longer
+            lines = ["last write: bit cell = %d ns" % values[64]]
+            lines += ["%5.1f us: %d" % (i * 0.2, values[i]) for i in range(64) if values[i]]
+            self.mq3.put("\n".join(lines))
+        elif info_id == INFO_BULK_ERROR:
+            offset, length, drvno, error = struct.unpack("<IIBB", data)
+            if drvno < 4 and self.path[drvno] and offset < len(self.image[drvno]):
+                sys.stderr.write("[B%d]" % error); sys.stderr.flush()
+                self.uploads.put((drvno, self.upload_serial[drvno], (offset, length)))
 
     def slip_decode(self, c):
         if self.escaping:
@@ -214,6 +437,11 @@ class Emulator(threading.Thread):
             else:
                 return c
 
+    def bulk(self, drvno, offset, length):
+        data = self.image[drvno][offset:offset+length]
+        header = struct.pack("<BIII", drvno, offset, len(data), zlib.crc32(data) & 0xffffffff)
+        return "".join([END, OP_BULK, self.slip_encode(header), data])
+
     def slip_encode(self, data):
         return data.replace(ESC, ESC+ESC_ESC).replace(END, ESC+ESC_END)
 
@@ -224,9 +452,11 @@ class Emulator(threading.Thread):
 parser = argparse.ArgumentParser()
 parser.add_argument("-a", "--address", metavar="ADDRESS", default="192.168.4.1", help="drive IP address")
 parser.add_argument("-p", "--port", metavar="PORT", default=4500, type=int, help="drive TCP port")
+parser.add_argument("-d", "--data-port", metavar="PORT", default=4502, type=int, help="drive TCP port for image uploads")
+parser.add_argument("-x", "--aux-port", metavar="PORT", default=4501, type=int, help="drive TCP port for image ids")
 args = parser.parse_args()
 
-emu = Emulator(args.address, args.port)
+emu = Emulator(args.address, args.port, args.data_port, args.aux_port)
 emu.start()
 
 while True:
@@ -258,6 +488,8 @@ while True:
             print "usage: e[ject] 0|1|2|3"
     elif "status".startswith(cmd):
         print emu
+    elif cmd == "stats":
+        print emu.stats() or "no response"
     elif "protect".startswith(cmd):
         if len(tokens) == 2 and tokens[1] in ["0", "1", "2", "3"]:
             emu.write_protect(int(tokens[1]), True)
@@ -269,14 +501,31 @@ while True:
         else:
             print "usage: u[nprotect] 0|1|2|3"
         pass
+    elif "delay".startswith(cmd):
+        try:
+            delay = int(round(float(tokens[2]) * 10))
+        except (IndexError, ValueError):
+            delay = -1
+        if len(tokens) == 3 and tokens[1] in ["0", "1", "2", "3"] and 1 <= delay <= 255:
+            emu.read_delay(int(tokens[1]), delay)
+        else:
+            print "usage: d[elay] 0|1|2|3 MS (0.1-25.5)"
+    elif cmd == "policy":
+        if len(tokens) == 2 and tokens[1] in POLICIES:
+            emu.policy(POLICIES.index(tokens[1]))
+        else:
+            print "usage: policy %s" % "|".join(POLICIES)
     elif "help".startswith(cmd):
         print "commands:\n"
         print "q[uit], exit           - exit program"
         print "i[nsert] 0|1|2|3 PATH  - insert floppy image"
         print "e[ject] 0|1|2|3        - eject floppy image"
         print "s[tatus]               - print current status"
+        print "stats                  - print track cache and write-back statistics"
+        print "policy POLICY          - set write-back order (round-robin, oldest, selected-last)"
         print "p[rotect] 0|1|2|3      - write protect floppy image"
         print "u[nprotect] 0|1|2|3    - write un-protect floppy image"
+        print "d[elay] 0|1|2|3 MS     - set minimum read delay after seek"
         print "h[elp]                 - print this information"
         print ""
 
@@ -0,0 +1,217 @@
+#!/usr/bin/env python
+
+# Checks that writes a lost connection never delivered reach the image file
+# after the host reconnects. A fake device stands in for the ESP8266 and the
+# STM32, phloppy_0.py runs as it would for a user.
+# Usage: resync_test.py [PORT] - the fake device listens on PORT to PORT+2
+
+import hashlib
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+END = "\xc0"
+ESC = "\xdb"
+ESC_END = "\xdc"
+ESC_ESC = "\xdd"
+
+OP_ACK = 0x28
+OP_RESYNC = 0x29
+OP_UPLOAD = 0x2c
+OP_ARGS = {OP_ACK: 3, OP_RESYNC: 1, OP_UPLOAD: 2}
+SECTOR_FRAME = 0x40
+
+ADF_SIZE = 160 * 11 * 512
+# Sectors 6, 7 and 10: the low mask byte is END and goes out escaped
+TT = 5
+GEN = 1
+MASK = 0x4c0
+
+
+def slip_encode(data):
+    return data.replace(ESC, ESC + ESC_ESC).replace(END, ESC + ESC_END)
+
+
+def sector_data(sector):
+    return chr(0xc0 + sector) * 512
+
+
+class Device(object):
+    def __init__(self, port):
+        self.ids = "\0" * 80
+        self.ops = []
+        self.uploads = 0
+        self.lock = threading.Lock()
+        self.changed = threading.Condition(self.lock)
+        for offset, handler in [(0, self.serve_main), (1, self.serve_aux), (2, self.serve_data)]:
+            server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            server.bind(("127.0.0.1", port + offset))
+            server.listen(4)
+            thread = threading.Thread(target=self.accept, args=(server, handler))
+            thread.daemon = True
+            thread.start()
+
+    def accept(self, server, handler):
+        while True:
+            conn, address = server.accept()
+            thread = threading.Thread(target=handler, args=(conn,))
+            thread.daemon = True
+            thread.start()
+
+    def ops_of(self, conn):
+        op = None
+        args = []
+        escape = False
+        while True:
+            data = conn.recv(4096)
+            if not data:
+                return
+            for c in data:
+                if escape:
+                    escape = False
+                    c = {ESC_END: END, ESC_ESC: ESC}.get(c, c)
+                elif c == END:
+                    op = -1
+                    continue
+                elif c == ESC:
+                    escape = True
+                    continue
+                if op == -1:
+                    op = ord(c)
+                    args = []
+                elif op is not None:
+                    args.append(ord(c))
+                else:
+                    continue
+                if len(args) == OP_ARGS.get(op, 0):
+                    yield op, args
+                    op = None
+
+    def serve_main(self, conn):
+        for op, args in self.ops_of(conn):
+            with self.lock:
+                self.ops.append((op, args))
+                self.changed.notify_all()
+            if op == OP_RESYNC and args == [0]:
+                self.send_track(conn)
+
+    def serve_data(self, conn):
+        # Bulk payloads are not SLIP encoded, only count the uploads
+        while True:
+            data = conn.recv(65536)
+            if not data:
+                return
+            if END + chr(OP_UPLOAD) in data:
+                with self.lock:
+                    self.uploads += 1
+
+    def serve_aux(self, conn):
+        with self.lock:
+            conn.sendall(self.ids)
+        data = ""
+        while True:
+            chunk = conn.recv(80)
+            if not chunk:
+                break
+            data += chunk
+        if len(data) == 80:
+            with self.lock:
+                self.ids = data
+                self.changed.notify_all()
+        conn.close()
+
+    # The written sectors of track TT, which no host acknowledged yet
+    def send_track(self, conn):
+        frame = [END, chr(SECTOR_FRAME | 0), slip_encode(chr(TT) + chr(GEN) + chr(MASK & 0xff) + chr(MASK >> 8))]
+        frame += [slip_encode(sector_data(s)) for s in range(11) if MASK & (1 << s)]
+        conn.sendall("".join(frame))
+
+    def wait(self, what, timeout=10):
+        deadline = time.time() + timeout
+        with self.lock:
+            while not what():
+                if time.time() > deadline:
+                    return False
+                self.changed.wait(0.1)
+            return True
+
+
+def run_client(port, commands):
+    client = subprocess.Popen([sys.executable, os.path.join(os.path.dirname(os.path.abspath(__file__)), "phloppy_0.py"),
+            "-a", "127.0.0.1", "-p", str(port), "-x", str(port + 1), "-d", str(port + 2)],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    for command in commands:
+        send_command(client, command)
+        time.sleep(0.5)
+    return client
+
+
+def send_command(client, command):
+    try:
+        client.stdin.write(command + "\n")
+        client.stdin.flush()
+    except IOError:
+        # Exited already, the checks tell what went wrong
+        pass
+
+
+def quit_client(client):
+    send_command(client, "quit")
+    client.stdin.close()
+    output = client.stdout.read()
+    client.wait()
+    return output
+
+
+def main():
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 14500
+    failures = []
+    image = tempfile.NamedTemporaryFile(suffix=".adf", delete=False)
+    image.write("\0" * ADF_SIZE)
+    image.close()
+
+    device = Device(port)
+
+    # First session: the image is uploaded, then the host goes away before the
+    # Amiga writes track TT
+    client = run_client(port, ["insert 0 " + image.name])
+    if not device.wait(lambda: device.ids[:20] == hashlib.sha1("\0" * ADF_SIZE).digest()):
+        failures.append("first session did not store the image id")
+    quit_client(client)
+    uploads = device.uploads
+
+    # Second session: the same image, unprotected - the device resends the track
+    client = run_client(port, ["insert 0 " + image.name, "unprotect 0"])
+    if not device.wait(lambda: (OP_ACK, [0, TT, GEN]) in device.ops):
+        failures.append("track %d not acknowledged" % TT)
+    output = quit_client(client)
+
+    data = open(image.name, "rb").read()
+    os.unlink(image.name)
+    if device.uploads != uploads:
+        failures.append("image uploaded again, the lost writes would be overwritten")
+    if (OP_RESYNC, [0]) not in device.ops:
+        failures.append("no resync of drive 0")
+    for s in range(11):
+        offset = (TT * 11 + s) * 512
+        expected = sector_data(s) if MASK & (1 << s) else "\0" * 512
+        if data[offset:offset+512] != expected:
+            failures.append("sector %d of track %d wrong" % (s, TT))
+    if device.ids[:20] != hashlib.sha1(data).digest():
+        failures.append("image id not updated after the write")
+
+    for failure in failures:
+        print failure
+    if failures:
+        print output
+    print "resync: %s" % ("FAILED" if failures else "ok")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,46 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MFM_H
+#define _MFM_H
+
+#define MFM_SYNC		0x44894489
+
+// [long word] info, label, header checksum, data checksum, data (odd & even halves)
+#define MFM_SECTOR_SIZE		(2 + 2*4 + 2 + 2 + 2*512/4)
+
+typedef struct {
+	unsigned int *data;				// decoded track, 11 sectors
+	unsigned int prev_long;
+	int shift;					// sync word bit offset, -1 while searching
+	int count;
+	unsigned int received_sectors;			// bit mask
+	unsigned int changed_sectors;			// bit mask, received with different data
+	unsigned int header_errors;
+	unsigned int data_errors;
+	unsigned int sector[MFM_SECTOR_SIZE] __attribute__((aligned(4)));	// staging, committed to data if the checksums match (word aligned under -fpack-struct)
+} Mfm_decoder;
+
+unsigned int mfm_checksum(unsigned int *data, int length);
+// Returns 0 if *target (if not 0) no longer equals cylinder between two sectors
+int mfm_encode_track(unsigned int *user_data, unsigned int *mfm, int cylinder, int head, const volatile int *target);
+void mfm_decoder_init(Mfm_decoder *decoder, unsigned int *data);
+void mfm_decode_long(Mfm_decoder *decoder, unsigned int value);
+void mfm_decode(Mfm_decoder *decoder, unsigned int *mfm, int length);
+
+#endif
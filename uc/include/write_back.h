@@ -0,0 +1,54 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WRITE_BACK_H
+#define _WRITE_BACK_H
+
+// [track]
+#define DISK_TRACKS	160
+
+// Written tracks to be sent to the host. Sent sectors stay unacknowledged
+// until the host acknowledges the track's generation (OP_ACK), and are sent
+// again after OP_RESYNC or with the next generation.
+typedef struct {
+	unsigned int dirty_tracks[DISK_TRACKS / 32];			// bit (cylinder << 1) | head
+	unsigned short dirty_sectors[DISK_TRACKS];			// bit mask
+	unsigned short unacked_sectors[DISK_TRACKS];			// bit mask
+	unsigned char generations[DISK_TRACKS];
+	unsigned int dirty_since[DISK_TRACKS];				// ticks
+	int cursor;
+	unsigned int sent_tracks;
+	unsigned int header_errors;					// sectors dropped
+	unsigned int data_errors;					// sectors dropped
+	unsigned int lost_tracks;					// writes not captured
+} Write_back;
+
+void queue_dirty_track(Write_back *wb, int tt, unsigned int sectors, unsigned int now);
+// Moves the dirty sectors of a track being sent to the unacknowledged ones
+void sent_dirty_track(Write_back *wb, int tt);
+void ack_track(Write_back *wb, int tt, int generation);
+// Sends all unacknowledged sectors again, e.g. after the host reconnected
+void resync_write_back(Write_back *wb, unsigned int now);
+void clear_write_back(Write_back *wb);
+// Finds the next dirty track at or after the cursor and clears its bit.
+// Tracks written again before they are sent are only sent once.
+int next_dirty_track(Write_back *wb, unsigned int *tt);
+// Returns the number of dirty tracks, and the age of the oldest one
+int dirty_track_count(Write_back *wb, int *oldest_tt, unsigned int *age, unsigned int now);
+
+#endif
@@ -18,6 +18,8 @@
 
 #include <stm32f446xx.h>
 #include "fmc.h"
+#include "mfm.h"
+#include "write_back.h"
 #include "wifi_parameters.h"
 
 #ifndef VERSION
@@ -30,16 +32,60 @@
 // [long word]
 #define RAW_TRACK_SIZE	(12668/4)
 
+// [us] one revolution, 2 us MFM bit cells
+#define TRACK_PERIOD_US	(RAW_TRACK_SIZE * 32 * 2)
+
 // [long word]
 #define MFM_TRACK_SIZE	(11*1088/4)
 // [long word]
 #define MFM_GAP_SIZE	(RAW_TRACK_SIZE - MFM_TRACK_SIZE)
-#define READ_DELAY_US	10000
+// Encoded tracks kept in SRAM, 12.7 KB each
+#define TRACK_POOL_SIZE	8
+// Default settle time before reading, the track must also be encoded
+#define READ_DELAY_US	3000
 
 // [long word]
 #define ADF_TRACK_SIZE	(512*11 / 4)
 
-#define MAX_DIRTY_TTS	256
+// Encoded tracks in the SDRAM left over by ADF images
+// [long word]
+#define SDRAM_CACHE_OFFSET	(160 * ADF_TRACK_SIZE)
+// [track]
+#define SDRAM_CACHE_SLOTS	((0x200000/4 - SDRAM_CACHE_OFFSET) / RAW_TRACK_SIZE)
+// [byte] SDRAM window of each drive
+#define DRIVE_DATA_SIZE	0x200000
+#define BULK_ERROR_QUEUE	8
+
+// STEP pulses closer than this belong to one seek [100 us]
+#define SEEK_STEP_INTERVAL	60
+
+// [flux transition]
+#define DKRD_DMA_SIZE	64
+// [flux transition]
+#define WRITE_FLUX_SIZE	2048
+#define MAX_WRITE_SESSIONS	4
+// MFM bit cell [TIM8 tick << 8]
+#define BITCELL_NOMINAL	((TIM8_FREQ * 2 / 1000000) << 8)
+#define BITCELL_MIN	(BITCELL_NOMINAL - BITCELL_NOMINAL/8)
+#define BITCELL_MAX	(BITCELL_NOMINAL + BITCELL_NOMINAL/8)
+// Bit cell correction is 1/PLL_GAIN of the phase error per bit
+#define PLL_GAIN	8
+#define FLUX_HISTOGRAM_BINS	64		// 2 TIM8 ticks each
+
+// [byte] ESP8266 SPI transaction. Frames from the ESP8266: FRAME_* header, payload;
+// frames to the ESP8266: non-zero if there is data, payload
+#define ESP_FRAME_SIZE	64
+#define FRAME_LENGTH	0x3f		// of the payload
+#define FRAME_DATA	0x40		// data channel (bulk port) instead of control channel (main port)
+#define FRAME_RESET	0x80		// the channel's host connection was restarted
+// Most frames the ESP8266 clocks back to back within one MREQ/SREQ handshake
+#define ESP_BURST_FRAMES	16
+// Least time between the end of a burst and SREQ raised without MREQ [100 us]
+#define ESP_ATTENTION_DELAY	10
+
+#if TRACK_POOL_SIZE < MAX_WRITE_SESSIONS + 3
+#error "TRACK_POOL_SIZE too small"
+#endif
 
 #define HCLK		160000000
 #define PCLK1		40000000
@@ -49,8 +95,9 @@
 
 #define TIM3_FREQ	10000
 #define TIM4_FREQ	2000000
-#define TIM5_FREQ	2000
+#define TIM5_FREQ	10000
 #define TIM6_FREQ	1000000
+#define TIM7_FREQ	10000
 #define TIM8_FREQ	10000000
 #define TIM12_FREQ	10000000
 
@@ -67,14 +114,6 @@
 #define FLOPPY2_SEL	(GPIOD->IDR & (1 << SEL2))
 #define FLOPPY3_SEL	(GPIOD->IDR & (1 << SEL3))
 
-#define EMPTY_TRACK_MASK_FLOPPY0_HEAD0	0x01
-#define EMPTY_TRACK_MASK_FLOPPY0_HEAD1	0x02
-#define EMPTY_TRACK_MASK_FLOPPY1_HEAD0	0x04
-#define EMPTY_TRACK_MASK_FLOPPY1_HEAD1	0x08
-#define EMPTY_TRACK_MASK_FLOPPY2_HEAD0	0x10
-#define EMPTY_TRACK_MASK_FLOPPY2_HEAD1	0x20
-#define EMPTY_TRACK_MASK_FLOPPY3_HEAD0	0x40
-#define EMPTY_TRACK_MASK_FLOPPY3_HEAD1	0x80
 
 #define END		0xc0
 #define ESC		0xdb
@@ -84,22 +123,92 @@
 typedef enum {
 	NOP,
 	OP,
-	TRANSMIT
+	TRANSMIT,
+	ARGS,
+	BULK
 } State;
 
+typedef struct {
+	unsigned int *mfm_track;
+	unsigned int *data;
+	int drive;
+	int tt;								// (cylinder << 1) | head
+	int raw;
+	int start;							// write_flux_buffer index
+	volatile int end;						// write_flux_buffer index, -1 while DKWEB is active
+	volatile int overrun;						// fluxes overwritten before they were decoded
+} Write_session;
+
+// -fpack-struct drops member alignment; mfm_track is read and written as
+// words and handed out as unsigned int *.
+typedef struct {
+	unsigned int mfm_track[RAW_TRACK_SIZE] __attribute__((aligned(4)));
+	int drive;							// -1: unused
+	int cylinder;
+	int head;
+	int empty;
+	unsigned int last_used;						// track_pool_clock
+} Track_buffer;
+
+typedef struct {
+	unsigned short histogram[FLUX_HISTOGRAM_BINS];			// captured flux intervals, saturated at 0xffff
+	unsigned short bitcell;						// [ns]
+} Flux_stats;
+
 typedef enum {
-	SYNC_WORD,
-	INFO_ODD,
-	INFO_EVEN,
-	LABEL_ODD,
-	LABEL_EVEN,
-	HDR_CHECKSUM_ODD,
-	HDR_CHECKSUM_EVEN,
-	DATA_CHECKSUM_ODD,
-	DATA_CHECKSUM_EVEN,
-	DATA_ODD,
-	DATA_EVEN
-} Decode_state;
+	ROUND_ROBIN,
+	OLDEST_FIRST,
+	SELECTED_DRIVE_LAST						// round robin, selected drive only if the others are done
+} Write_back_policy;
+
+typedef struct {
+	unsigned char valid[SDRAM_CACHE_SLOTS];
+	int fill;							// first slot to check for background encoding
+	unsigned int hits;
+	unsigned int misses;
+} Sdram_cache;
+
+// The main loop owns the SPI frames in ESP_IDLE and ESP_DONE
+typedef enum {
+	ESP_IDLE,							// preparing TX frames
+	ESP_READY,							// TX frames ready, waiting for MREQ
+	ESP_ARMED,							// DMA running, SREQ raised
+	ESP_DONE							// RX frames to be processed
+} Esp_state;
+
+// OP_BULK upload in progress
+typedef struct {
+	int drive;							// -1: payload discarded
+	unsigned int offset;						// [byte]
+	unsigned int length;						// [byte]
+	unsigned int remaining;						// [byte]
+	unsigned int crc;
+	unsigned int expected_crc;
+} Bulk_transfer;
+
+// Host to device byte stream, the ESP8266 carries a control and a data channel
+typedef struct {
+	// Image upload bytes of one ESP burst, plus up to 3 left over from the
+	// previous one. Explicitly aligned, the struct is packed.
+	unsigned int fill_staging[ESP_BURST_FRAMES*ESP_FRAME_SIZE/4 + 1] __attribute__((aligned(4)));
+	unsigned int fill_count;					// [byte]
+	State state;
+	int op;
+	int argc;
+	int escape;							// SLIP
+	unsigned char *fill_ptr;
+	unsigned int *delay_ptr;
+	Bulk_transfer bulk;
+	unsigned char args[13];						// last, keeps the words above aligned
+} Channel;
+
+// Failed OP_BULK upload, to be sent again by the host
+typedef struct {
+	unsigned int offset;						// [byte]
+	unsigned int length;						// [byte]
+	unsigned char drive;
+	unsigned char error;
+} Bulk_error;
 
 #define OP_NOP		0x00
 #define OP_INSERT0	0x01
@@ -130,8 +239,38 @@ typedef enum {
 #define OP_TYPE1_RAW	0x20
 #define OP_TYPE2_RAW	0x21
 #define OP_TYPE3_RAW	0x22
+#define OP_DELAY0	0x23
+#define OP_DELAY1	0x24
+#define OP_DELAY2	0x25
+#define OP_DELAY3	0x26
+#define OP_GET_STATS	0x27
+#define OP_ACK		0x28		// drive, tt, generation
+#define OP_RESYNC	0x29		// drive
+#define OP_POLICY	0x2a		// Write_back_policy
+// drive, offset (LE32), length (LE32), CRC-32 of the payload (LE32) - SLIP encoded,
+// followed by the payload bytes as they are. The offset must be a multiple of 4.
+#define OP_BULK		0x2b
+// drive, serial - SLIP encoded. On the data channel it starts an upload: the
+// drive is ejected and the following ops for it belong to that upload. On the
+// control channel it cancels uploads with an older serial and ejects the drive,
+// unless the upload with this serial has already started.
+#define OP_UPLOAD	0x2c
 #define OP_SETUP_WIFI	0x80
 
+// Drive number field of device to host info frames: END, INFO_FRAME, id, length, data
+#define INFO_FRAME	0x10
+#define INFO_CACHE_STATS	0x01
+#define INFO_WRITE_BACK_STATS	0x02
+#define INFO_FLUX_HISTOGRAM	0x03
+#define INFO_BULK_ERROR	0x04
+#define BULK_CRC_ERROR	1
+#define BULK_RANGE_ERROR	2
+// Written tracks: END, drive, tt, generation, raw track
+// Drive number field of frames with written ADF sectors: END, SECTOR_FRAME | drive,
+// tt, generation, sector mask (low byte, high byte), 512 bytes per sector in the mask
+#define SECTOR_FRAME	0x40
+#define ALL_SECTORS	0x7ff
+
 // PA
 #define FLOP1_TRK0	8
 #define ENA3		9
@@ -234,25 +373,38 @@ const unsigned short dkrd_tim_arr_lut[] = {2*TIM4_FREQ/1000000-1, 4*TIM4_FREQ/10
 
 volatile int timer0 = 0;
 volatile int timer1 = SDRAM_IDLE_TIME;
-
-unsigned int mfm_track_floppy0_head0[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy0_head1[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy1_head0[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy1_head1[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy2_head0[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy2_head1[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy3_head0[RAW_TRACK_SIZE];
-unsigned int mfm_track_floppy3_head1[RAW_TRACK_SIZE];
-unsigned int *mfm_track = mfm_track_floppy0_head0;
+volatile unsigned int ticks;						// [100 us]
+
+unsigned short dkrd_dma_buffer[DKRD_DMA_SIZE];			// TIM4 ARR values, one per flux transition
+
+Track_buffer track_pool[TRACK_POOL_SIZE];
+volatile unsigned int track_pool_clock;
+Track_buffer *volatile encoding_buffer;
+Sdram_cache sdram_caches[4];
+unsigned int info_frame_data[24];
+Channel control_channel;
+Channel data_channel;
+// Image upload serials (OP_UPLOAD), per drive
+unsigned char upload_serials[4];						// of the data channel's upload
+unsigned char cancel_serials[4];						// last one announced on the control channel
+unsigned int uploads_started;							// bit drive, since the data connection started
+unsigned int cancels_valid;							// bit drive, since the data connection started
+int wifi_setup;
+int stats_requested;
+// SPI bursts with the ESP8266, see esp_arm()
+char rx_buffer[ESP_BURST_FRAMES*ESP_FRAME_SIZE];
+char tx_frames[ESP_BURST_FRAMES*ESP_FRAME_SIZE];
+volatile Esp_state esp_state;
+volatile int esp_frames;						// exchanged in the last burst
+volatile unsigned int esp_done_time;					// ticks
+Bulk_error bulk_errors[BULK_ERROR_QUEUE];
+unsigned int bulk_error_ri;
+unsigned int bulk_error_wi;
+unsigned int *mfm_track = track_pool[0].mfm_track;
 volatile unsigned int current_mfm_long;
 volatile unsigned int mfm_offset;
 volatile unsigned int mfm_bitmask;
-volatile unsigned int mfm_bitcount;
-volatile unsigned int mfm_track_type;
-volatile unsigned int received_sectors;
 volatile unsigned int current_track_empty;
-volatile unsigned int empty_tracks;
-volatile Decode_state mfm_decode_state;
 volatile int mfm_break;
 volatile unsigned int floppy_type;					// 0: ADF, 1: raw
 unsigned int *floppy0_data = (unsigned int *) 0xd0000000;
@@ -267,19 +419,41 @@ int floppy0_write_protected = 1;
 int floppy1_write_protected = 1;
 int floppy2_write_protected = 1;
 int floppy3_write_protected = 1;
-volatile unsigned int *written_track_start;
-unsigned char floppy0_dirty_tts[MAX_DIRTY_TTS];				// (cylinder << 1) | head
-unsigned char floppy1_dirty_tts[MAX_DIRTY_TTS];				// (cylinder << 1) | head
-unsigned char floppy2_dirty_tts[MAX_DIRTY_TTS];				// (cylinder << 1) | head
-unsigned char floppy3_dirty_tts[MAX_DIRTY_TTS];				// (cylinder << 1) | head
-volatile int floppy0_dirty_tt_wi = 0;
-volatile int floppy1_dirty_tt_wi = 0;
-volatile int floppy2_dirty_tt_wi = 0;
-volatile int floppy3_dirty_tt_wi = 0;
-volatile int floppy0_dirty_tt_ri = 0;
-volatile int floppy1_dirty_tt_ri = 0;
-volatile int floppy2_dirty_tt_ri = 0;
-volatile int floppy3_dirty_tt_ri = 0;
+unsigned int floppy0_read_delay = READ_DELAY_US * TIM5_FREQ / 1000000;	// [TIM5 tick]
+unsigned int floppy1_read_delay = READ_DELAY_US * TIM5_FREQ / 1000000;	// [TIM5 tick]
+unsigned int floppy2_read_delay = READ_DELAY_US * TIM5_FREQ / 1000000;	// [TIM5 tick]
+unsigned int floppy3_read_delay = READ_DELAY_US * TIM5_FREQ / 1000000;	// [TIM5 tick]
+volatile int read_start_pending;
+volatile int encoding_drive = -1;
+volatile int encoding_head;
+volatile int encoding_cylinder;						// set to -1 to abort the encoder
+volatile unsigned int floppy0_step_time;
+volatile unsigned int floppy1_step_time;
+volatile unsigned int floppy2_step_time;
+volatile unsigned int floppy3_step_time;
+volatile unsigned int floppy0_step_interval = SEEK_STEP_INTERVAL;
+volatile unsigned int floppy1_step_interval = SEEK_STEP_INTERVAL;
+volatile unsigned int floppy2_step_interval = SEEK_STEP_INTERVAL;
+volatile unsigned int floppy3_step_interval = SEEK_STEP_INTERVAL;
+unsigned short write_flux_buffer[WRITE_FLUX_SIZE];		// TIM8 CCR1 captures
+int write_flux_ri;
+Write_session write_sessions[MAX_WRITE_SESSIONS];
+Write_session *volatile current_write_session;
+volatile int write_session_wi;
+int write_session_ri;
+int write_session_open;
+unsigned int *written_track;
+unsigned int *written_track_start;
+unsigned long long written_mfm_bits;
+unsigned int written_offset;
+unsigned int written_bitcount;
+Mfm_decoder mfm_decoder;
+unsigned int written_bitcell;						// [TIM8 tick << 8]
+unsigned short flux_histogram[FLUX_HISTOGRAM_BINS];
+Flux_stats flux_stats;							// of the last write
+Write_back write_backs[4];
+Write_back_policy write_back_policy = OLDEST_FIRST;
+int write_back_drive;							// next drive for round robin
 
 inline void sdram_enter_low_power_mode()
 {
@@ -293,25 +467,211 @@ inline void sdram_exit_low_power_mode()
 	GPIOC->BSRR = 0x10000 << LED_GREEN;
 }
 
+Track_buffer *find_track(int drive, int cylinder, int head)
+{
+	int i;
+
+	for (i = 0; i < TRACK_POOL_SIZE; i++) {
+		if (track_pool[i].drive == drive && track_pool[i].cylinder == cylinder && track_pool[i].head == head) {
+			return &track_pool[i];
+		}
+	}
+	return 0;
+}
+
+// Returns 1 if a write session into the buffer has not been drained yet
+int track_write_pending(Track_buffer *buffer)
+{
+	int i;
+
+	for (i = write_session_ri; i != write_session_wi; i++) {
+		if (write_sessions[i & (MAX_WRITE_SESSIONS-1)].mfm_track == buffer->mfm_track) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int track_buffer_busy(Track_buffer *buffer)
+{
+	if (buffer == encoding_buffer) {
+		return 1;
+	}
+	if (buffer->mfm_track == mfm_track && (TIM4->CR1 & TIM_CR1_CEN)) {
+		return 1;
+	}
+	return track_write_pending(buffer);
+}
+
+// Returns an unused or the least recently used track buffer which is not
+// being streamed, encoded or written. Call with interrupts disabled.
+Track_buffer *reuse_track_buffer()
+{
+	Track_buffer *lru = 0;
+	Track_buffer *buffer;
+	int i;
+
+	for (i = 0; i < TRACK_POOL_SIZE; i++) {
+		buffer = &track_pool[i];
+		if (track_buffer_busy(buffer)) {
+			continue;
+		}
+		if (buffer->drive < 0) {
+			return buffer;
+		}
+		if (!lru || (int) (buffer->last_used - lru->last_used) < 0) {
+			lru = buffer;
+		}
+	}
+	if (lru) {
+		lru->drive = -1;
+	}
+	return lru;
+}
+
+// The SDRAM cache is filled starting at the root block cylinder and working
+// outwards (40, 39, 41, 38, ...) because that's where AmigaDOS allocates blocks
+int sdram_cache_slot(int cylinder, int head)
+{
+	int slot = (cylinder >= 40 ? (cylinder - 40) * 2 : (40 - cylinder) * 2 - 1) * 2 + head;
+
+	return slot < SDRAM_CACHE_SLOTS ? slot : -1;
+}
+
+inline void invalidate_sdram_cache(int drive, int cylinder, int head)
+{
+	int slot = sdram_cache_slot(cylinder, head);
+
+	if (slot >= 0) {
+		sdram_caches[drive].valid[slot] = 0;
+		if (sdram_caches[drive].fill > slot) {
+			sdram_caches[drive].fill = slot;
+		}
+	}
+}
+
+void invalidate_tracks(int drive)
+{
+	int i;
+
+	__disable_irq();
+	for (i = 0; i < TRACK_POOL_SIZE; i++) {
+		if (track_pool[i].drive == drive) {
+			track_pool[i].drive = -1;
+		}
+	}
+	for (i = 0; i < SDRAM_CACHE_SLOTS; i++) {
+		sdram_caches[drive].valid[i] = 0;
+	}
+	sdram_caches[drive].fill = 0;
+	__enable_irq();
+}
+
+void eject_drive(int drive)
+{
+	invalidate_tracks(drive);
+	switch (drive) {
+		case 0:
+			GPIOC->BSRR = 1 << FLOP0_TRK0;
+			GPIOC->BSRR = 0x10000 << ENA0;
+			break;
+		case 1:
+			GPIOA->BSRR = 1 << FLOP1_TRK0;
+			GPIOC->BSRR = 0x10000 << ENA1;
+			break;
+		case 2:
+			GPIOA->BSRR = 1 << FLOP2_TRK0;
+			GPIOA->BSRR = 0x10000 << ENA2;
+			break;
+		case 3:
+			GPIOB->BSRR = 1 << FLOP3_TRK0;
+			GPIOA->BSRR = 0x10000 << ENA3;
+			break;
+	}
+}
+
 void select_mfm_track()
 {
 	int head = (GPIOD->IDR & (1 << SIDE)) == 0;
+	Track_buffer *buffer = 0;
+
+	if (!FLOPPY0_SEL) {
+		buffer = find_track(0, floppy0_current_cylinder, head);
+	} else if (!FLOPPY1_SEL) {
+		buffer = find_track(1, floppy1_current_cylinder, head);
+#if VERSION != 0
+	} else if (!FLOPPY2_SEL) {
+		buffer = find_track(2, floppy2_current_cylinder, head);
+	} else {
+		buffer = find_track(3, floppy3_current_cylinder, head);
+#endif
+	}
+	if (buffer) {
+		buffer->last_used = ++track_pool_clock;
+		mfm_track = buffer->mfm_track;
+		current_track_empty = buffer->empty;
+	} else {
+		current_track_empty = 1;
+	}
+}
+
+int selected_drive()
+{
+	if (!FLOPPY0_SEL) {
+		return 0;
+	} else if (!FLOPPY1_SEL) {
+		return 1;
+#if VERSION != 0
+	} else if (!FLOPPY2_SEL) {
+		return 2;
+	} else {
+		return 3;
+#endif
+	}
+	return -1;
+}
+
+// A track still being filled from a write session is not ready: its buffer
+// holds a mix of old and newly written data until drain_write_flux is done.
+inline int track_ready(int drive, int cylinder, int head)
+{
+	Track_buffer *buffer = find_track(drive, cylinder, head);
+
+	return buffer && !track_write_pending(buffer);
+}
+
+int mfm_track_ready()
+{
+	int head = (GPIOD->IDR & (1 << SIDE)) == 0;
+
+	if (!FLOPPY0_SEL) {
+		return !(GPIOC->ODR & (1 << ENA0)) || track_ready(0, floppy0_current_cylinder, head);
+	} else if (!FLOPPY1_SEL) {
+		return !(GPIOC->ODR & (1 << ENA1)) || track_ready(1, floppy1_current_cylinder, head);
+#if VERSION != 0
+	} else if (!FLOPPY2_SEL) {
+		return !(GPIOA->ODR & (1 << ENA2)) || track_ready(2, floppy2_current_cylinder, head);
+	} else {
+		return !(GPIOA->ODR & (1 << ENA3)) || track_ready(3, floppy3_current_cylinder, head);
+#endif
+	}
+	return 1;
+}
 
+unsigned int selected_read_delay()
+{
 	if (!FLOPPY0_SEL) {
-		mfm_track = head ? mfm_track_floppy0_head1 : mfm_track_floppy0_head0;
-		current_track_empty = (empty_tracks & (head ? EMPTY_TRACK_MASK_FLOPPY0_HEAD1 : EMPTY_TRACK_MASK_FLOPPY0_HEAD0)) != 0;
+		return floppy0_read_delay;
 	} else if (!FLOPPY1_SEL) {
-		mfm_track = head ? mfm_track_floppy1_head1 : mfm_track_floppy1_head0;
-		current_track_empty = (empty_tracks & (head ? EMPTY_TRACK_MASK_FLOPPY1_HEAD1 : EMPTY_TRACK_MASK_FLOPPY1_HEAD0)) != 0;
+		return floppy1_read_delay;
 #if VERSION != 0
 	} else if (!FLOPPY2_SEL) {
-		mfm_track = head ? mfm_track_floppy2_head1 : mfm_track_floppy2_head0;
-		current_track_empty = (empty_tracks & (head ? EMPTY_TRACK_MASK_FLOPPY2_HEAD1 : EMPTY_TRACK_MASK_FLOPPY2_HEAD0)) != 0;
+		return floppy2_read_delay;
 	} else {
-		mfm_track = head ? mfm_track_floppy3_head1 : mfm_track_floppy3_head0;
-		current_track_empty = (empty_tracks & (head ? EMPTY_TRACK_MASK_FLOPPY3_HEAD1 : EMPTY_TRACK_MASK_FLOPPY3_HEAD0)) != 0;
+		return floppy3_read_delay;
 #endif
 	}
+	return READ_DELAY_US * TIM5_FREQ / 1000000;
 }
 
 inline void start_index_pulse()
@@ -333,6 +693,13 @@ void TIM3_IRQHandler()
 	stop_index_pulse();
 }
 
+// INDEX once per revolution while DKWEB is active, the fluxes are only decoded later
+void TIM7_IRQHandler()
+{
+	TIM7->SR = 0;
+	start_index_pulse();
+}
+
 inline void wrap_mfm_offset()
 {
 	if (++mfm_offset == RAW_TRACK_SIZE) {
@@ -352,163 +719,274 @@ inline void next_mfm_bit()
 	}
 }
 
-void TIM4_IRQHandler()
+void fill_dkrd_buffer(unsigned short *buffer, int length)
 {
 	int k;
 
+	while (length--) {
+		// Skip '1' bit
+		next_mfm_bit();
+
+		// Count '0' bits. Valid MFM has at most three in a row, but a raw
+		// track or one whose encoding was abandoned by a seek can hold longer
+		// runs; cap them so k stays inside dkrd_tim_arr_lut and a zeroed
+		// track cannot keep the ISR spinning.
+		for (k = 0; !(current_mfm_long & mfm_bitmask) && k < 3; k++) {
+			next_mfm_bit();
+		}
+		*buffer++ = dkrd_tim_arr_lut[k];
+	}
+}
+
+void DMA1_Stream6_IRQHandler()
+{
+	// Refill the half of the buffer which has just been loaded into TIM4->ARR.
+	// INDEX is generated while filling, so it leads the DKRD data by at most
+	// DKRD_DMA_SIZE flux transitions.
+	if (DMA1->HISR & DMA_HISR_HTIF6) {
+		DMA1->HIFCR = DMA_HIFCR_CHTIF6;
+		fill_dkrd_buffer(dkrd_dma_buffer, DKRD_DMA_SIZE/2);
+	}
+	if (DMA1->HISR & DMA_HISR_TCIF6) {
+		DMA1->HIFCR = DMA_HIFCR_CTCIF6;
+		fill_dkrd_buffer(dkrd_dma_buffer + DKRD_DMA_SIZE/2, DKRD_DMA_SIZE/2);
+	}
+}
+
+void TIM4_IRQHandler()
+{
 	TIM4->SR = 0;
 
 	if (mfm_break) {
 		// Stop sending track data
 		TIM4->CCMR1 = 4 << TIM_CCMR1_OC1M_Pos;			// Force inactive level
 		TIM4->CR1 = 0;
+		TIM4->DIER = TIM_DIER_UDE;
+		DMA1_Stream6->CR &= ~DMA_SxCR_EN;
 		if (mfm_break == 2) {
 			TIM5->EGR = TIM_EGR_UG;				// Trigger immediate track sending
 		}
 		mfm_break = 0;
 		GPIOD->BSRR = 1 << LED_YELLOW;
+	}
+}
+
+inline void wrap_written_offset()
+{
+	if (++written_offset == RAW_TRACK_SIZE) {
+		written_offset = 0;
+	}
+}
+
+void store_written_long(unsigned int value, int raw)
+{
+	written_track[written_offset] = value;
+	if (raw) {
+		written_track_start[written_offset] = __REV(value);
 	} else {
-		// Skip '1' bit
-		next_mfm_bit();
+		mfm_decode_long(&mfm_decoder, value);
+	}
+	wrap_written_offset();
+}
 
-		// Count '0' bits
-		for (k = 0; !(current_mfm_long & mfm_bitmask); k++) {
-			next_mfm_bit();
-		}
-		TIM4->ARR = dkrd_tim_arr_lut[k];
+inline void flush_written_bits(int raw)
+{
+	unsigned int padding;
+
+	if (written_bitcount) {
+		padding = (written_mfm_bits & 1) ? 0x55555555 : 0xaaaaaaaa;
+		store_written_long((written_mfm_bits << (32 - written_bitcount)) | (padding >> written_bitcount), raw);
+		written_bitcount = 0;
 	}
 }
 
-void decode_bit(unsigned int bit)
+void decode_flux(unsigned short ccr1, int raw)
 {
-	static unsigned int *odd_lword;
-	static unsigned int *even_lword;
-	static unsigned int info;
+	int interval = ccr1 << 8;
+	int bin = ccr1/2 < FLUX_HISTOGRAM_BINS ? ccr1/2 : FLUX_HISTOGRAM_BINS-1;
+	int k;
 
-	current_mfm_long = (current_mfm_long << 1) | bit;
-	mfm_bitcount++;
+	// A track has ~50000 fluxes, most of them in a few bins; saturate rather
+	// than wrap so the info frame keeps 16 bit bins
+	if (flux_histogram[bin] != 0xffff) {
+		flux_histogram[bin]++;
+	}
 
-	if (mfm_bitcount == 32) {
-		mfm_track[mfm_offset] = current_mfm_long;
-		wrap_mfm_offset();
+	// 4 us - '10', 6 us - '100', 8 us - '1000' at the nominal bit cell
+	k = (interval + written_bitcell/2) / written_bitcell;
+	if (k < 2) {
+		k = 2;
+	} else if (k > 4) {
+		k = 4;
 	}
 
-	switch (mfm_decode_state) {
-		case SYNC_WORD:
-			if (current_mfm_long == 0x44894489) {
-				mfm_decode_state = INFO_ODD;
-				mfm_bitcount = 0;
-				received_sectors++;
-			}
-			break;
-		case INFO_ODD:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = INFO_EVEN;
-				mfm_bitcount = 0;
-				info = (current_mfm_long & 0x55555555) << 1;
-			}
-			break;
-		case INFO_EVEN:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = LABEL_ODD;
-				mfm_bitcount = 0;
-				info |= current_mfm_long & 0x55555555;
-				odd_lword = even_lword = (unsigned int *) &written_track_start[((info >> 8) & 0xff) << (9-2)];
-			}
-			break;
-		case LABEL_ODD:
-			if (mfm_bitcount == 4*32) {
-				mfm_decode_state = LABEL_EVEN;
-				mfm_bitcount = 0;
-			}
-			break;
-		case LABEL_EVEN:
-			if (mfm_bitcount == 4*32) {
-				mfm_decode_state = HDR_CHECKSUM_ODD;
-				mfm_bitcount = 0;
-			}
-			break;
-		case HDR_CHECKSUM_ODD:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = HDR_CHECKSUM_EVEN;
-				mfm_bitcount = 0;
-			}
-			break;
-		case HDR_CHECKSUM_EVEN:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = DATA_CHECKSUM_ODD;
-				mfm_bitcount = 0;
-			}
-			break;
-		case DATA_CHECKSUM_ODD:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = DATA_CHECKSUM_EVEN;
-				mfm_bitcount = 0;
-			}
-			break;
-		case DATA_CHECKSUM_EVEN:
-			if (mfm_bitcount == 32) {
-				mfm_decode_state = DATA_ODD;
-				mfm_bitcount = 0;
-			}
-			break;
-		case DATA_ODD:
-			if (mfm_bitcount && ((mfm_bitcount & 31) == 0)) {
-				*odd_lword++ = __REV((current_mfm_long & 0x55555555) << 1);
-			}
-			if (mfm_bitcount == 512/4*32) {
-				mfm_decode_state = DATA_EVEN;
-				mfm_bitcount = 0;
-			}
-			break;
-		case DATA_EVEN:
-			if (mfm_bitcount && ((mfm_bitcount & 31) == 0)) {
-				*even_lword++ |= __REV(current_mfm_long & 0x55555555);
-			}
-			if (mfm_bitcount == 512/4*32) {
-				mfm_decode_state = SYNC_WORD;
-				mfm_bitcount = 0;
+	// Follow the Amiga's clock
+	written_bitcell += (interval - k * (int) written_bitcell) / (k * PLL_GAIN);
+	if (written_bitcell < BITCELL_MIN) {
+		written_bitcell = BITCELL_MIN;
+	} else if (written_bitcell > BITCELL_MAX) {
+		written_bitcell = BITCELL_MAX;
+	}
+
+	written_mfm_bits = (written_mfm_bits << k) | (1 << (k-1));
+	written_bitcount += k;
+	if (written_bitcount >= 32) {
+		written_bitcount -= 32;
+		store_written_long(written_mfm_bits >> written_bitcount, raw);
+	}
+}
+
+// Picks the next track to send according to write_back_policy, returns its drive or -1
+int next_write_back(unsigned int *tt)
+{
+	unsigned int oldest_age = 0;
+	unsigned int age;
+	int oldest_drive = -1;
+	int oldest_tt = 0;
+	int skip = -1;
+	int drive;
+	int k;
+
+	if (write_back_policy == OLDEST_FIRST) {
+		for (drive = 0; drive < 4; drive++) {
+			if (dirty_track_count(&write_backs[drive], &k, &age, ticks) && (oldest_drive < 0 || age > oldest_age)) {
+				oldest_drive = drive;
+				oldest_tt = k;
+				oldest_age = age;
 			}
-			break;
+		}
+		if (oldest_drive >= 0) {
+			*tt = oldest_tt;
+			write_backs[oldest_drive].dirty_tracks[oldest_tt >> 5] &= ~(1 << (oldest_tt & 31));
+			write_backs[oldest_drive].sent_tracks++;
+		}
+		return oldest_drive;
+	}
+
+	if (write_back_policy == SELECTED_DRIVE_LAST) {
+		skip = selected_drive();
+	}
+	for (k = 0; k < 4; k++) {
+		drive = (write_back_drive + k) & 3;
+		if (drive != skip && next_dirty_track(&write_backs[drive], tt)) {
+			write_back_drive = (drive + 1) & 3;
+			write_backs[drive].sent_tracks++;
+			return drive;
+		}
+	}
+	if (skip >= 0 && next_dirty_track(&write_backs[skip], tt)) {
+		write_backs[skip].sent_tracks++;
+		return skip;
 	}
+	return -1;
 }
 
-void decode_raw_bit(unsigned int bit)
+unsigned int *drive_data(int drive)
 {
-	current_mfm_long = (current_mfm_long << 1) | bit;
-	if (++mfm_bitcount == 32) {
-		mfm_bitcount = 0;
-		mfm_track[mfm_offset] = current_mfm_long;
-		written_track_start[mfm_offset] = __REV(current_mfm_long);
-		wrap_mfm_offset();
+	switch (drive) {
+		case 0:
+			return floppy0_data;
+		case 1:
+			return floppy1_data;
+		case 2:
+			return floppy2_data;
+		default:
+			return floppy3_data;
 	}
 }
 
-void TIM8_CC_IRQHandler()
+// The capture DMA starts on a half of write_flux_buffer. If the main loop is
+// still decoding there, it fell behind by half the ring and fluxes are lost.
+// Until drain_write_flux opens the head session, its fluxes start at ws->start.
+inline void check_write_flux_overrun(int start)
 {
-	int k;
-	unsigned short ccr1 = TIM8->CCR1;
+	Write_session *ws = &write_sessions[write_session_ri & (MAX_WRITE_SESSIONS-1)];
+	int ri;
 
-	if (ccr1 < (TIM8_FREQ * 5 / 1000000)) {
-		// 4 us - '10'
-		k = 2;
-	} else if (ccr1 < (TIM8_FREQ * 7 / 1000000)) {
-		// 6 us - '100'
-		k = 3;
-	} else {
-		// 8 us - '1000'
-		k = 4;
+	if (write_session_ri != write_session_wi) {
+		ri = write_session_open ? write_flux_ri : ws->start;
+		if (ri > start && ri < start + WRITE_FLUX_SIZE/2) {
+			ws->overrun = 1;
+		}
+	}
+}
+
+void DMA2_Stream2_IRQHandler()
+{
+	if (DMA2->LISR & DMA_LISR_HTIF2) {
+		DMA2->LIFCR = DMA_LIFCR_CHTIF2;
+		check_write_flux_overrun(WRITE_FLUX_SIZE/2);
 	}
-	if (mfm_track_type) {			// Raw track
-		decode_raw_bit(1);
-		while (--k) {
-			decode_raw_bit(0);
+	if (DMA2->LISR & DMA_LISR_TCIF2) {
+		DMA2->LIFCR = DMA_LIFCR_CTCIF2;
+		check_write_flux_overrun(0);
+	}
+}
+
+void drain_write_flux()
+{
+	Write_session *ws;
+	Track_buffer *buffer;
+	int end;
+
+	while (write_session_ri != write_session_wi) {
+		ws = &write_sessions[write_session_ri & (MAX_WRITE_SESSIONS-1)];
+		if (!write_session_open) {
+			// Both at once for check_write_flux_overrun()
+			__disable_irq();
+			write_flux_ri = ws->start;
+			write_session_open = 1;
+			__enable_irq();
+			written_track = ws->mfm_track;
+			written_track_start = ws->data;
+			written_mfm_bits = 0;
+			written_bitcount = 0;
+			written_offset = 0;
+			written_bitcell = BITCELL_NOMINAL;
+			for (end = 0; end < FLUX_HISTOGRAM_BINS; end++) {
+				flux_histogram[end] = 0;
+			}
+			mfm_decoder_init(&mfm_decoder, ws->data);
+		}
+
+		// Decode everything captured so far
+		end = ws->end;
+		while (write_flux_ri != (end < 0 ? WRITE_FLUX_SIZE - DMA2_Stream2->NDTR : end)) {
+			decode_flux(write_flux_buffer[write_flux_ri], ws->raw);
+			write_flux_ri = (write_flux_ri + 1) & (WRITE_FLUX_SIZE-1);
 		}
-	} else {				// ADF track
-		decode_bit(1);
-		while (--k) {
-			decode_bit(0);
+		if (end < 0) {
+			// DKWEB still active
+			break;
+		}
+
+		// DKWEB rising edge - all fluxes decoded
+		flush_written_bits(ws->raw);
+		for (end = 0; end < FLUX_HISTOGRAM_BINS; end++) {
+			flux_stats.histogram[end] = flux_histogram[end];
+		}
+		flux_stats.bitcell = (written_bitcell * (1000000000 / TIM8_FREQ)) >> 8;
+		write_backs[ws->drive].header_errors += mfm_decoder.header_errors;
+		write_backs[ws->drive].data_errors += mfm_decoder.data_errors;
+		if (ws->overrun) {
+			// Sectors with good checksums were kept, the rest has to be
+			// encoded from SDRAM again. Raw tracks are lost altogether.
+			write_backs[ws->drive].lost_tracks++;
+			buffer = find_track(ws->drive, ws->tt >> 1, ws->tt & 1);
+			if (buffer) {
+				buffer->drive = -1;
+			}
+			if (ws->raw) {
+				write_session_open = 0;
+				write_session_ri++;
+				continue;
+			}
+		}
+		if (mfm_decoder.changed_sectors || ws->raw) {
+			queue_dirty_track(&write_backs[ws->drive], ws->tt, ws->raw ? ALL_SECTORS : mfm_decoder.changed_sectors, ticks);
 		}
+		write_session_open = 0;
+		write_session_ri++;
 	}
 }
 
@@ -529,6 +1007,7 @@ void wait_ms(int ms)
 void TIM6_DAC_IRQHandler()
 {
 	TIM6->SR = 0;
+	ticks++;
 	if (timer0) {
 		timer0--;
 	}
@@ -547,14 +1026,28 @@ void TIM5_IRQHandler()
 	// Stop this timer
 	TIM5->CR1 = 0;
 
+	// Wait for the encoder, the main loop retriggers this timer
+	if (!mfm_track_ready()) {
+		read_start_pending = 1;
+		return;
+	}
+	read_start_pending = 0;
+
 	// Start sending track data
 	select_mfm_track();
 	mfm_break = 0;
 	mfm_offset = 0;
 	mfm_bitmask = 0x80000000;
-	mfm_bitcount = 0;
 	current_mfm_long = mfm_track[mfm_offset++];
 	if (!current_track_empty) {
+		fill_dkrd_buffer(dkrd_dma_buffer, DKRD_DMA_SIZE);
+		DMA1_Stream6->CR = 0;
+		while (DMA1_Stream6->CR & DMA_SxCR_EN);
+		DMA1->HIFCR = DMA_HIFCR_CTCIF6 | DMA_HIFCR_CHTIF6 | DMA_HIFCR_CTEIF6 | DMA_HIFCR_CDMEIF6 | DMA_HIFCR_CFEIF6;
+		DMA1_Stream6->NDTR = DKRD_DMA_SIZE;
+		DMA1_Stream6->CR = (2 << DMA_SxCR_CHSEL_Pos) | (1 << DMA_SxCR_MSIZE_Pos) | (1 << DMA_SxCR_PSIZE_Pos) |
+			DMA_SxCR_MINC | DMA_SxCR_CIRC | (1 << DMA_SxCR_DIR_Pos) | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN;
+		TIM4->DIER = TIM_DIER_UDE;
 		TIM4->CCMR1 = 6 << TIM_CCMR1_OC1M_Pos;			// PWM mode 1 (active when CNT<CCR1)
 		TIM4->CR1 = TIM_CR1_CEN;
 	}
@@ -564,16 +1057,23 @@ void TIM5_IRQHandler()
 
 inline void stop_sending_track_data()
 {
+	// Stop at the next flux transition (see TIM4_IRQHandler)
 	mfm_break = 1;
+	TIM4->SR = ~TIM_SR_UIF;
+	TIM4->DIER = TIM_DIER_UDE | TIM_DIER_UIE;
 }
 
 inline void stop_sending_track_data_now()
 {
 	mfm_break = 2;
+	TIM4->SR = ~TIM_SR_UIF;
+	TIM4->DIER = TIM_DIER_UDE | TIM_DIER_UIE;
 }
 
 inline void restart_send_delay_timer()
 {
+	read_start_pending = 0;
+	TIM5->ARR = selected_read_delay() - 1;
 	TIM5->CNT = 0;
 	TIM5->CR1 = TIM_CR1_CEN;
 	sdram_exit_low_power_mode();
@@ -582,6 +1082,7 @@ inline void restart_send_delay_timer()
 inline void stop_send_delay_timer()
 {
 	TIM5->CR1 = 0;
+	read_start_pending = 0;
 }
 
 inline void exti_sel0()
@@ -593,7 +1094,6 @@ inline void exti_sel0()
 		stop_index_pulse();
 	} else {						// falling edge
 		restart_send_delay_timer();
-		mfm_track_type = (floppy_type & 0x01) != 0;
 		if (floppy0_write_protected) {
 			GPIOB->BSRR = 0x10000 << WPROT;
 		}
@@ -609,7 +1109,6 @@ inline void exti_sel1()
 		stop_index_pulse();
 	} else {						// falling edge
 		restart_send_delay_timer();
-		mfm_track_type = (floppy_type & 0x02) != 0;
 		if (floppy1_write_protected) {
 			GPIOB->BSRR = 0x10000 << WPROT;
 		}
@@ -626,7 +1125,6 @@ inline void exti_sel2()
 			stop_index_pulse();
 		} else {						// falling edge
 			restart_send_delay_timer();
-			mfm_track_type = (floppy_type & 0x04) != 0;
 			if (floppy2_write_protected) {
 				GPIOB->BSRR = 0x10000 << WPROT;
 			}
@@ -644,7 +1142,6 @@ inline void exti_sel3()
 			stop_index_pulse();
 		} else {						// falling edge
 			restart_send_delay_timer();
-			mfm_track_type = (floppy_type & 0x08) != 0;
 			if (floppy3_write_protected) {
 				GPIOB->BSRR = 0x10000 << WPROT;
 			}
@@ -666,6 +1163,11 @@ inline void exti_step()
 				floppy0_current_cylinder++;
 			}
 		}
+		floppy0_step_interval = ticks - floppy0_step_time;
+		floppy0_step_time = ticks;
+		if (encoding_drive == 0) {
+			encoding_cylinder = -1;
+		}
 		GPIOC->BSRR = (floppy0_current_cylinder == 0 ? 0x10000 : 1) << FLOP0_TRK0;
 	} else if (FLOPPY1_SEL == 0) {
 		if (GPIOB->IDR & (1 << DIR)) {
@@ -677,6 +1179,11 @@ inline void exti_step()
 				floppy1_current_cylinder++;
 			}
 		}
+		floppy1_step_interval = ticks - floppy1_step_time;
+		floppy1_step_time = ticks;
+		if (encoding_drive == 1) {
+			encoding_cylinder = -1;
+		}
 		GPIOA->BSRR = (floppy1_current_cylinder == 0 ? 0x10000 : 1) << FLOP1_TRK0;
 	} else if (FLOPPY2_SEL == 0) {
 		if (GPIOB->IDR & (1 << DIR)) {
@@ -688,6 +1195,11 @@ inline void exti_step()
 				floppy2_current_cylinder++;
 			}
 		}
+		floppy2_step_interval = ticks - floppy2_step_time;
+		floppy2_step_time = ticks;
+		if (encoding_drive == 2) {
+			encoding_cylinder = -1;
+		}
 		GPIOA->BSRR = (floppy2_current_cylinder == 0 ? 0x10000 : 1) << FLOP2_TRK0;
 	} else {
 		if (GPIOB->IDR & (1 << DIR)) {
@@ -699,6 +1211,11 @@ inline void exti_step()
 				floppy3_current_cylinder++;
 			}
 		}
+		floppy3_step_interval = ticks - floppy3_step_time;
+		floppy3_step_time = ticks;
+		if (encoding_drive == 3) {
+			encoding_cylinder = -1;
+		}
 		GPIOB->BSRR = (floppy3_current_cylinder == 0 ? 0x10000 : 1) << FLOP3_TRK0;
 	}
 
@@ -707,56 +1224,30 @@ inline void exti_step()
 
 inline void exti_side()
 {
+	// Let the encoder switch to the newly selected head
+	if (encoding_drive == selected_drive() && encoding_head != ((GPIOD->IDR & (1 << SIDE)) == 0) && !mfm_track_ready()) {
+		encoding_cylinder = -1;
+	}
 	restart_send_delay_timer();
 	stop_sending_track_data_now();
 }
 
-inline void flush_last_raw_lword()
-{
-	int i;
-
-	for (i = 0; i < 31; i++) {
-		decode_raw_bit(~(current_mfm_long & 1));
-	}
-}
-
 inline void exti_dkweb()
 {
 	int head = (GPIOD->IDR & (1 << SIDE)) == 0;
-	int track_size;
+	Write_session *ws;
+	Track_buffer *buffer;
 
 	if (GPIOD->IDR & (1 << DKWEB)) {
 		// rising edge
-		if (FLOPPY0_SEL == 0) {
-			if (floppy_type & 0x01) {
-				flush_last_raw_lword();
-			}
-			if (received_sectors > 0 || floppy_type & 0x01) {
-				floppy0_dirty_tts[floppy0_dirty_tt_wi++ & (MAX_DIRTY_TTS-1)] = (floppy0_current_cylinder << 1) | head;
-			}
-		} else if (FLOPPY1_SEL == 0) {
-			if (floppy_type & 0x02) {
-				flush_last_raw_lword();
-			}
-			if (received_sectors > 0 || floppy_type & 0x02) {
-				floppy1_dirty_tts[floppy1_dirty_tt_wi++ & (MAX_DIRTY_TTS-1)] = (floppy1_current_cylinder << 1) | head;
-			}
-		} else if (FLOPPY2_SEL == 0) {
-			if (floppy_type & 0x04) {
-				flush_last_raw_lword();
-			}
-			if (received_sectors > 0 || floppy_type & 0x04) {
-				floppy2_dirty_tts[floppy2_dirty_tt_wi++ & (MAX_DIRTY_TTS-1)] = (floppy2_current_cylinder << 1) | head;
-			}
-		} else {
-			if (floppy_type & 0x08) {
-				flush_last_raw_lword();
-			}
-			if (received_sectors > 0 || floppy_type & 0x08) {
-				floppy3_dirty_tts[floppy3_dirty_tt_wi++ & (MAX_DIRTY_TTS-1)] = (floppy3_current_cylinder << 1) | head;
-			}
-		}
 		TIM8->CR1 = 0;
+		TIM7->CR1 = 0;
+		if (current_write_session) {
+			// The main loop decodes the captured fluxes up to this point
+			// before queueing the track (see drain_write_flux)
+			current_write_session->end = WRITE_FLUX_SIZE - DMA2_Stream2->NDTR;
+			current_write_session = 0;
+		}
 		restart_send_delay_timer();
 		start_index_pulse();
 	} else {
@@ -767,49 +1258,111 @@ inline void exti_dkweb()
 			       	(FLOPPY1_SEL == 0 && !floppy1_write_protected) ||
 				(FLOPPY2_SEL == 0 && !floppy2_write_protected) ||
 				(FLOPPY3_SEL == 0 && !floppy3_write_protected)) {
-			current_mfm_long = 0x00000000;
-			mfm_bitcount = 0;
-			mfm_offset = 0;
-			mfm_decode_state = SYNC_WORD;
-			received_sectors = 0;
-			if (FLOPPY0_SEL == 0) {
-				if (floppy_type & 0x01) {
-					track_size = RAW_TRACK_SIZE;
-				} else {
-					track_size = ADF_TRACK_SIZE;
+			if (write_session_wi - write_session_ri == MAX_WRITE_SESSIONS) {
+				// The main loop is still decoding earlier writes
+				if (selected_drive() >= 0) {
+					write_backs[selected_drive()].lost_tracks++;
 				}
-				mfm_track = head ? mfm_track_floppy0_head1 : mfm_track_floppy0_head0;
-				written_track_start = floppy0_data + ((floppy0_current_cylinder << 1) | head) * track_size;
+				return;
+			}
+			ws = &write_sessions[write_session_wi & (MAX_WRITE_SESSIONS-1)];
+			ws->start = WRITE_FLUX_SIZE - DMA2_Stream2->NDTR;
+			ws->end = -1;
+			ws->overrun = 0;
+			if (FLOPPY0_SEL == 0) {
+				ws->drive = 0;
+				ws->raw = (floppy_type & 0x01) != 0;
+				ws->tt = (floppy0_current_cylinder << 1) | head;
+				ws->data = floppy0_data;
 			} else if (FLOPPY1_SEL == 0) {
-				if (floppy_type & 0x02) {
-					track_size = RAW_TRACK_SIZE;
-				} else {
-					track_size = ADF_TRACK_SIZE;
-				}
-				mfm_track = head ? mfm_track_floppy1_head1 : mfm_track_floppy1_head0;
-				written_track_start = floppy1_data + ((floppy1_current_cylinder << 1) | head) * track_size;
+				ws->drive = 1;
+				ws->raw = (floppy_type & 0x02) != 0;
+				ws->tt = (floppy1_current_cylinder << 1) | head;
+				ws->data = floppy1_data;
 			} else if (FLOPPY2_SEL == 0) {
-				if (floppy_type & 0x04) {
-					track_size = RAW_TRACK_SIZE;
-				} else {
-					track_size = ADF_TRACK_SIZE;
-				}
-				mfm_track = head ? mfm_track_floppy2_head1 : mfm_track_floppy2_head0;
-				written_track_start = floppy2_data + ((floppy2_current_cylinder << 1) | head) * track_size;
+				ws->drive = 2;
+				ws->raw = (floppy_type & 0x04) != 0;
+				ws->tt = (floppy2_current_cylinder << 1) | head;
+				ws->data = floppy2_data;
 			} else {
-				if (floppy_type & 0x08) {
-					track_size = RAW_TRACK_SIZE;
-				} else {
-					track_size = ADF_TRACK_SIZE;
-				}
-				mfm_track = head ? mfm_track_floppy3_head1 : mfm_track_floppy3_head0;
-				written_track_start = floppy3_data + ((floppy2_current_cylinder << 1) | head) * track_size;
+				ws->drive = 3;
+				ws->raw = (floppy_type & 0x08) != 0;
+				ws->tt = (floppy3_current_cylinder << 1) | head;
+				ws->data = floppy3_data;
+			}
+			ws->data += ws->tt * (ws->raw ? RAW_TRACK_SIZE : ADF_TRACK_SIZE);
+			buffer = find_track(ws->drive, ws->tt >> 1, head);
+			if (buffer) {
+				buffer->empty = 0;
+			} else {
+				// Not cached, the track is encoded from SDRAM again later
+				buffer = reuse_track_buffer();
 			}
+			ws->mfm_track = buffer->mfm_track;
+			if (encoding_drive == ws->drive) {
+				encoding_cylinder = -1;
+			}
+			invalidate_sdram_cache(ws->drive, ws->tt >> 1, head);
+			current_write_session = ws;
+			write_session_wi++;
 			TIM8->CR1 = TIM_CR1_CEN;
+			TIM7->CNT = 0;
+			TIM7->CR1 = TIM_CR1_CEN;
 		}
 	}
 }
 
+// Starts a burst with the prepared frames, call with interrupts disabled.
+// SREQ raised while MREQ is low asks the ESP8266 for a burst (data for the host).
+void esp_arm()
+{
+	// Prepare SPI transmission
+	// Stream 2 flags are left to DMA2_Stream2_IRQHandler
+	DMA2->LIFCR = DMA_LIFCR_CTCIF0 | DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTEIF0 | DMA_LIFCR_CDMEIF0 | DMA_LIFCR_CFEIF0;
+	DMA2->HIFCR = DMA_HIFCR_CTCIF4 | DMA_HIFCR_CHTIF4 | DMA_HIFCR_CTEIF4 | DMA_HIFCR_CDMEIF4 | DMA_HIFCR_CFEIF4;
+	DMA2_Stream0->PAR = (uint32_t) &SPI4->DR;
+	DMA2_Stream4->PAR = (uint32_t) &SPI4->DR;
+	DMA2_Stream0->M0AR = (uint32_t) rx_buffer;
+	DMA2_Stream4->M0AR = (uint32_t) tx_frames;
+	DMA2_Stream0->NDTR = ESP_BURST_FRAMES*ESP_FRAME_SIZE;
+	DMA2_Stream4->NDTR = ESP_BURST_FRAMES*ESP_FRAME_SIZE;
+	DMA2_Stream0->CR = (4 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | (0 << DMA_SxCR_DIR_Pos) | DMA_SxCR_EN;
+	DMA2_Stream4->CR = (5 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | (1 << DMA_SxCR_DIR_Pos) | DMA_SxCR_EN;
+	esp_state = ESP_ARMED;
+
+	// Signal to master readiness for transmission
+	GPIOG->BSRR = 1 << SREQ;
+}
+
+inline void exti_mreq()
+{
+	int frames;
+
+	if (GPIOG->IDR & (1 << MREQ)) {
+		// rising edge - the ESP8266 waits for SREQ
+		if (esp_state == ESP_READY) {
+			esp_arm();
+		}
+	} else if (esp_state == ESP_ARMED) {
+		// falling edge - burst done, the master may send fewer frames than a full burst
+		frames = (ESP_BURST_FRAMES*ESP_FRAME_SIZE - DMA2_Stream0->NDTR) / ESP_FRAME_SIZE;
+		if (frames < ESP_BURST_FRAMES) {
+			// Stop the DMA and drop the byte already loaded for the next frame
+			DMA2_Stream0->CR = 0;
+			DMA2_Stream4->CR = 0;
+			while ((DMA2_Stream0->CR | DMA2_Stream4->CR) & DMA_SxCR_EN);
+			RCC->APB2RSTR |= RCC_APB2RSTR_SPI4RST;
+			RCC->APB2RSTR &= ~RCC_APB2RSTR_SPI4RST;
+			SPI4->CR2 = SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN;
+			SPI4->CR1 = SPI_CR1_SPE;
+		}
+		GPIOG->BSRR = 0x10000 << SREQ;
+		esp_frames = frames;
+		esp_done_time = ticks;
+		esp_state = ESP_DONE;
+	}
+}
+
 void EXTI3_IRQHandler()
 {
 	if (EXTI->PR & (1 << SEL0)) {
@@ -855,117 +1408,171 @@ void EXTI15_10_IRQHandler()
 		EXTI->PR = 1 << DKWEB;
 		exti_dkweb();
 	}
+
+	if (EXTI->PR & (1 << MREQ)) {
+		EXTI->PR = 1 << MREQ;
+		exti_mreq();
+	}
 }
 
-void esp_transaction(char *tx_buffer, char *rx_buffer)
+int encode_mfm_track(unsigned int *user_data, unsigned int *mfm_track, int cylinder, int head, const volatile int *target)
 {
-	// Prepare SPI transmission
-	DMA2->LIFCR = DMA2->LISR;
-	DMA2->HIFCR = DMA2->HISR;
-	DMA2_Stream0->PAR = (uint32_t) &SPI4->DR;
-	DMA2_Stream4->PAR = (uint32_t) &SPI4->DR;
-	DMA2_Stream0->M0AR = (uint32_t) rx_buffer;
-	DMA2_Stream4->M0AR = (uint32_t) tx_buffer;
-	DMA2_Stream0->NDTR = 64;
-	DMA2_Stream4->NDTR = 64;
-	DMA2_Stream0->CR = (4 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | (0 << DMA_SxCR_DIR_Pos) | DMA_SxCR_EN;
-	DMA2_Stream4->CR = (5 << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MINC | (1 << DMA_SxCR_DIR_Pos) | DMA_SxCR_EN;
-
-	// Signal to master readiness for transmission
-	GPIOG->BSRR = 1 << SREQ;
+	int i;
 
-	// Wait for transmission end
-	while (GPIOG->IDR & (1 << MREQ));
-	GPIOG->BSRR = 0x10000 << SREQ;
+	if (!mfm_encode_track(user_data, mfm_track, cylinder, head, target)) {
+		return 0;
+	}
+	for (i = MFM_TRACK_SIZE+1; i < MFM_TRACK_SIZE+MFM_GAP_SIZE; i++) {
+		mfm_track[i] = 0xaaaaaaaa;
+	}
+	return 1;
 }
 
-unsigned int mfm_checksum(unsigned int *data, int length)
+int encode_raw_track(unsigned int *user_data, Track_buffer *buffer, int cylinder, const volatile int *target)
 {
-	unsigned int result = 0;
-	while (length--) {
-		result ^= *data ^ (*data >> 1);
-		data++;
+	unsigned int *mfm_track = buffer->mfm_track;
+	int empty = 1;
+	int i;
+
+	for (i = 0; i < RAW_TRACK_SIZE; i++) {
+		if (!(i & 511) && target && *target != cylinder) {
+			return 0;
+		}
+		if (*user_data) {
+			empty = 0;
+		}
+		*mfm_track++ = __REV(*user_data++);
 	}
-	return result & 0x55555555;
+	buffer->empty = empty;
+	return 1;
 }
 
-unsigned int mfm_encode_long(unsigned int *buffer, unsigned int value, unsigned int prev_bit)
+// Returns 1 while STEP pulses keep coming at seek rate
+inline int seeking(unsigned int step_time, unsigned int step_interval)
 {
-	unsigned int x = value & 0x55555555;
-	*buffer = x | (0xaaaaaaaa & ~((x << 1) | ((x >> 1) | prev_bit)));
-	return value << 31;
+	return step_interval < SEEK_STEP_INTERVAL && ticks - step_time < step_interval + step_interval/2;
 }
 
-void encode_mfm_track(unsigned int *user_data, unsigned int *mfm_track, int cylinder, int head, unsigned int empty_track_mask)
+void copy_track(unsigned int *dst, unsigned int *src)
 {
-	int i;
-	int s;
-	unsigned int chksum;
-	unsigned int tt = ((cylinder << 1) | head) << 16;
-	unsigned int info;
-	unsigned int prev_bit = 0x00000000;
-
-	for (s = 0; s < 11; s++) {
-		*mfm_track++ = 0xaaaaaaaa ^ prev_bit;
-		*mfm_track++ = 0x44894489;
-		prev_bit = 0x80000000;
-
-		/* header */
-		info = 0xff000000 | tt | (s << 8) | (11 - s);		// info
-		chksum = mfm_checksum(&info, 1);
-
-		prev_bit = mfm_encode_long(mfm_track++, info >> 1, prev_bit);
-		prev_bit = mfm_encode_long(mfm_track++, info, prev_bit);
-		for (i = 0; i < 2*4; i++) {
-			prev_bit = mfm_encode_long(mfm_track++, 0, prev_bit);
-		}
-
-		/* header checksum */
-		prev_bit = mfm_encode_long(mfm_track++, chksum >> 1, prev_bit);
-		prev_bit = mfm_encode_long(mfm_track++, chksum, prev_bit);
-
-		/* data checksum */
-		chksum = __REV(mfm_checksum(user_data, 512/4));
-		prev_bit = mfm_encode_long(mfm_track++, chksum >> 1, prev_bit);
-		prev_bit = mfm_encode_long(mfm_track++, chksum, prev_bit);
+	DMA2_Stream1->CR = 0;
+	while (DMA2_Stream1->CR & DMA_SxCR_EN);
+	DMA2->LIFCR = DMA_LIFCR_CTCIF1 | DMA_LIFCR_CHTIF1 | DMA_LIFCR_CTEIF1 | DMA_LIFCR_CDMEIF1 | DMA_LIFCR_CFEIF1;
+	DMA2_Stream1->PAR = (unsigned int) src;
+	DMA2_Stream1->M0AR = (unsigned int) dst;
+	DMA2_Stream1->NDTR = RAW_TRACK_SIZE;
+	DMA2_Stream1->FCR = DMA_SxFCR_DMDIS | (3 << DMA_SxFCR_FTH_Pos);
+	DMA2_Stream1->CR = (2 << DMA_SxCR_MSIZE_Pos) | (2 << DMA_SxCR_PSIZE_Pos) | DMA_SxCR_MINC | DMA_SxCR_PINC |
+		(2 << DMA_SxCR_DIR_Pos) | DMA_SxCR_EN;		// memory to memory
+	while (!(DMA2->LISR & (DMA_LISR_TCIF1 | DMA_LISR_TEIF1)));
+}
 
-		/* data */
-		for (i = 0; i < 512/4; i++) {
-			prev_bit = mfm_encode_long(mfm_track++, __REV(user_data[i] >> 1), prev_bit);
-		}
-		for (i = 0; i < 512/4; i++) {
-			prev_bit = mfm_encode_long(mfm_track++, __REV(*user_data++), prev_bit);
-		}
+// Encodes the next missing track of an ADF image into the drive's SDRAM cache
+void fill_sdram_cache(int drive, unsigned int *data)
+{
+	Sdram_cache *cache = &sdram_caches[drive];
+	int slot;
+	int cylinder;
+	int head;
+	int done;
+
+	while (cache->fill < SDRAM_CACHE_SLOTS && cache->valid[cache->fill]) {
+		cache->fill++;
+	}
+	if (cache->fill == SDRAM_CACHE_SLOTS || write_session_ri != write_session_wi) {
+		return;
 	}
-	*mfm_track = 0xaaaaaaaa ^ prev_bit;
+	slot = cache->fill;
+	head = slot & 1;
+	cylinder = ((slot >> 1) & 1) ? 40 - ((slot >> 1) + 1) / 2 : 40 + (slot >> 1) / 2;
+
+	__disable_irq();
+	encoding_drive = drive;
+	encoding_head = head;
+	encoding_cylinder = cylinder;
+	__enable_irq();
+	sdram_exit_low_power_mode();
+	done = encode_mfm_track(data + ((cylinder << 1) | head) * ADF_TRACK_SIZE, data + SDRAM_CACHE_OFFSET + slot * RAW_TRACK_SIZE,
+		cylinder, head, &encoding_cylinder);
 
-	empty_tracks &= ~empty_track_mask;
+	__disable_irq();
+	if (done && encoding_cylinder == cylinder) {
+		cache->valid[slot] = 1;
+	}
+	encoding_drive = -1;
+	__enable_irq();
 }
 
-void encode_raw_track(unsigned int *user_data, unsigned int *mfm_track, unsigned int empty_track_mask)
+// Encodes a track into a reused pool buffer and makes it visible to
+// select_mfm_track(). Returns 0 if no buffer is free, if a written track is
+// still being decoded, or if exti_step() or exti_side() aborted the encoder.
+int encode_track(int drive, unsigned int *data, int raw, int cylinder, int head)
 {
-	int empty = 1;
-	int i;
+	Track_buffer *buffer;
+	int slot;
+	int done;
 
-	for (i = 0; i < RAW_TRACK_SIZE; i++) {
-		if (*user_data) {
-			empty = 0;
-		}
-		*mfm_track++ = __REV(*user_data++);
+	if (write_session_ri != write_session_wi) {
+		return 0;
+	}
+	__disable_irq();
+	buffer = reuse_track_buffer();
+	encoding_buffer = buffer;
+	encoding_drive = drive;
+	encoding_head = head;
+	encoding_cylinder = cylinder;
+	__enable_irq();
+	if (!buffer) {
+		encoding_drive = -1;
+		return 0;
 	}
-	if (empty) {
-		empty_tracks |= empty_track_mask;
+	slot = raw ? -1 : sdram_cache_slot(cylinder, head);
+	if (raw) {
+		done = encode_raw_track(data + ((cylinder << 1) | head) * RAW_TRACK_SIZE, buffer, cylinder, &encoding_cylinder);
+	} else if (slot >= 0 && sdram_caches[drive].valid[slot]) {
+		sdram_caches[drive].hits++;
+		copy_track(buffer->mfm_track, data + SDRAM_CACHE_OFFSET + slot * RAW_TRACK_SIZE);
+		buffer->empty = 0;
+		done = 1;
 	} else {
-		empty_tracks &= ~empty_track_mask;
+		sdram_caches[drive].misses++;
+		done = encode_mfm_track(data + ((cylinder << 1) | head) * ADF_TRACK_SIZE, buffer->mfm_track, cylinder, head, &encoding_cylinder);
+		buffer->empty = 0;
 	}
+
+	__disable_irq();
+	if (done && encoding_cylinder == cylinder) {
+		buffer->cylinder = cylinder;
+		buffer->head = head;
+		buffer->last_used = ++track_pool_clock;
+		buffer->drive = drive;
+	} else {
+		done = 0;
+	}
+	encoding_buffer = 0;
+	encoding_drive = -1;
+	__enable_irq();
+	return done;
 }
 
-static inline int slip_decode(unsigned char c)
+static inline int op_arg_count(int op)
 {
-	static int escape = 0;
+	switch (op) {
+		case OP_ACK:
+			return 3;
+		case OP_BULK:
+			return 13;
+		case OP_UPLOAD:
+			return 2;
+		default:
+			return 1;
+	}
+}
 
-	if (escape) {
-		escape = 0;
+static inline int slip_decode(unsigned char c, int *escape)
+{
+	if (*escape) {
+		*escape = 0;
 		if (c == ESC_END) {
 			return END;
 		} else if (c == ESC_ESC) {
@@ -977,7 +1584,7 @@ static inline int slip_decode(unsigned char c)
 		if (c == END) {
 			return -END;
 		} else if (c == ESC) {
-			escape = 1;
+			*escape = 1;
 			return -ESC;
 		} else {
 			return c;
@@ -985,6 +1592,179 @@ static inline int slip_decode(unsigned char c)
 	}
 }
 
+// Stores the staged image upload with long word writes and advances the fill pointer.
+// A partial long word is kept for the next frame unless all is set.
+void store_fill_data(Channel *ch, int all)
+{
+	unsigned int *src = ch->fill_staging;
+	unsigned char *dst = ch->fill_ptr;
+	unsigned int n = ch->fill_count / 4;
+	unsigned int i;
+
+	if (ch->fill_count == 0) {
+		return;
+	}
+	sdram_exit_low_power_mode();
+	for (i = 0; i < n; i++) {
+		((unsigned int *) dst)[i] = src[i];
+	}
+	dst += n * 4;
+	ch->fill_count -= n * 4;
+	if (ch->fill_count) {
+		src[0] = src[n];
+		if (all) {
+			for (i = 0; i < ch->fill_count; i++) {
+				*dst++ = ((unsigned char *) src)[i];
+			}
+			ch->fill_count = 0;
+		}
+	}
+	ch->fill_ptr = dst;
+}
+
+static const unsigned int crc32_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+// CRC-32 as in zlib, a nibble at a time
+unsigned int crc32_update(unsigned int crc, const char *data, int length)
+{
+	while (length--) {
+		crc ^= (unsigned char) *data++;
+		crc = (crc >> 4) ^ crc32_table[crc & 15];
+		crc = (crc >> 4) ^ crc32_table[crc & 15];
+	}
+	return crc;
+}
+
+static inline unsigned int le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+// Serials wrap at 256, a few uploads are in flight at most
+static inline int serial_older(unsigned char a, unsigned char b)
+{
+	return (signed char) (a - b) < 0;
+}
+
+static inline int upload_cancelled(Channel *ch, int drive)
+{
+	return ch == &data_channel && (cancels_valid & (1 << drive)) &&
+		serial_older(upload_serials[drive], cancel_serials[drive]);
+}
+
+// Image uploads on the data channel start with OP_UPLOAD there and end with
+// OP_INSERT. The control channel cancels them with OP_UPLOAD and a newer
+// serial. The channels are separate TCP connections, so the two may arrive
+// in either order; the serials sort them out.
+void start_upload(Channel *ch, int drive, unsigned char serial)
+{
+	if (ch == &data_channel) {
+		upload_serials[drive] = serial;
+		uploads_started |= 1 << drive;
+		if (!upload_cancelled(ch, drive)) {
+			eject_drive(drive);
+		}
+	} else {
+		cancel_serials[drive] = serial;
+		cancels_valid |= 1 << drive;
+		if (!(uploads_started & (1 << drive)) || serial_older(upload_serials[drive], serial)) {
+			eject_drive(drive);
+		}
+	}
+}
+
+// Sets the fill pointer for the payload, the payload of bad uploads is only counted
+void start_bulk(Channel *ch)
+{
+	Bulk_transfer *bulk = &ch->bulk;
+
+	bulk->drive = ch->args[0];
+	bulk->offset = le32(ch->args + 1);
+	bulk->length = le32(ch->args + 5);
+	bulk->remaining = bulk->length;
+	bulk->crc = 0xffffffff;
+	bulk->expected_crc = le32(ch->args + 9);
+	// store_fill_data stores whole words, so the offset must be word aligned
+	if (bulk->drive < 4 && !upload_cancelled(ch, bulk->drive) && !(bulk->offset & 3) &&
+			bulk->offset <= DRIVE_DATA_SIZE && bulk->length <= DRIVE_DATA_SIZE - bulk->offset) {
+		ch->fill_count = 0;
+		ch->fill_ptr = (unsigned char *) drive_data(bulk->drive) + bulk->offset;
+	} else {
+		bulk->drive = -1;
+		ch->fill_ptr = 0;
+	}
+}
+
+void queue_bulk_error(const Bulk_transfer *bulk, int drive, int error)
+{
+	Bulk_error *e;
+
+	if (bulk_error_wi - bulk_error_ri < BULK_ERROR_QUEUE) {
+		e = &bulk_errors[bulk_error_wi++ & (BULK_ERROR_QUEUE-1)];
+		e->offset = bulk->offset;
+		e->length = bulk->length;
+	} else {
+		// Queue full - ask for the whole image instead
+		e = &bulk_errors[(bulk_error_wi-1) & (BULK_ERROR_QUEUE-1)];
+		e->offset = 0;
+		e->length = DRIVE_DATA_SIZE;
+	}
+	e->drive = drive;
+	e->error = error;
+}
+
+void finish_bulk(Channel *ch)
+{
+	if (ch->bulk.drive < 0) {
+		if (ch->args[0] >= 4 || !upload_cancelled(ch, ch->args[0])) {
+			queue_bulk_error(&ch->bulk, ch->args[0], BULK_RANGE_ERROR);
+		}
+	} else if (~ch->bulk.crc != ch->bulk.expected_crc) {
+		queue_bulk_error(&ch->bulk, ch->bulk.drive, BULK_CRC_ERROR);
+	} else {
+		// Tracks of an inserted image may have been patched
+		invalidate_tracks(ch->bulk.drive);
+	}
+}
+
+// Drops a partly received op, e.g. the rest of an upload the host gave up on
+void reset_channel(Channel *ch)
+{
+	if (ch->state == TRANSMIT || ch->state == BULK) {
+		store_fill_data(ch, 1);
+	}
+	if (ch->state == BULK && ch->bulk.drive >= 0) {
+		invalidate_tracks(ch->bulk.drive);
+	}
+	ch->state = NOP;
+	ch->escape = 0;
+	if (ch == &data_channel) {
+		// A new host session, its serials start over
+		uploads_started = 0;
+		cancels_valid = 0;
+	}
+}
+
+// Returns the number of bytes stored
+int slip_append(char *buffer, unsigned char c)
+{
+	if (c == END) {
+		buffer[0] = ESC;
+		buffer[1] = ESC_END;
+		return 2;
+	} else if (c == ESC) {
+		buffer[0] = ESC;
+		buffer[1] = ESC_ESC;
+		return 2;
+	} else {
+		buffer[0] = c;
+		return 1;
+	}
+}
+
 int slip_encode(unsigned char c)
 {
 	static int escape = 0;
@@ -1008,22 +1788,307 @@ int slip_encode(unsigned char c)
 	}
 }
 
+// Parses a host to device byte stream
+void process_rx(Channel *ch, const char *data, int length)
+{
+	int c;
+	int i;
+
+	for (i = 0; i < length; i++) {
+		if (ch->state == BULK) {
+			// Raw payload up to the end of the frame
+			c = length - i < ch->bulk.remaining ? length - i : ch->bulk.remaining;
+			ch->bulk.crc = crc32_update(ch->bulk.crc, &data[i], c);
+			ch->bulk.remaining -= c;
+			if (ch->bulk.drive >= 0) {
+				while (c--) {
+					((unsigned char *) ch->fill_staging)[ch->fill_count++] = data[i++];
+				}
+			} else {
+				i += c;
+			}
+			i--;
+			if (ch->bulk.remaining == 0) {
+				store_fill_data(ch, 1);
+				finish_bulk(ch);
+				ch->state = NOP;
+			}
+			continue;
+		}
+		// Process next byte from input buffer
+		c = slip_decode(data[i], &ch->escape);
+		if (c == -END) {
+			if (ch->state == TRANSMIT) {
+				store_fill_data(ch, 1);
+			}
+			ch->state = OP;
+		} else if (c > -1) {
+			if (ch->state == TRANSMIT) {
+				((unsigned char *) ch->fill_staging)[ch->fill_count++] = c;
+			} else if (ch->state == ARGS) {
+				ch->args[ch->argc++] = c;
+				if (ch->argc == op_arg_count(ch->op)) {
+					ch->state = NOP;
+					switch (ch->op) {
+						case OP_DELAY0:
+						case OP_DELAY1:
+						case OP_DELAY2:
+						case OP_DELAY3:
+							// [100 us], at least one TIM5 tick
+							*ch->delay_ptr = c ? c : 1;
+							break;
+						case OP_ACK:
+							if (ch->args[0] < 4 && ch->args[1] < DISK_TRACKS) {
+								ack_track(&write_backs[ch->args[0]], ch->args[1], ch->args[2]);
+							}
+							break;
+						case OP_RESYNC:
+							// The host has the drive's image open and writable again
+							if (c < 4) {
+								resync_write_back(&write_backs[c], ticks);
+							}
+							break;
+						case OP_POLICY:
+							if (c <= SELECTED_DRIVE_LAST) {
+								write_back_policy = c;
+							}
+							break;
+						case OP_BULK:
+							ch->state = BULK;
+							start_bulk(ch);
+							if (ch->bulk.remaining == 0) {
+								finish_bulk(ch);
+								ch->state = NOP;
+							}
+							break;
+						case OP_UPLOAD:
+							if (ch->args[0] < 4) {
+								start_upload(ch, ch->args[0], c);
+							}
+							break;
+					}
+				}
+			} else if (ch->state == NOP) {
+				// pass
+			} else if (ch->state == OP) {
+				switch (c) {
+					case OP_NOP:
+						ch->state = NOP;
+						break;
+					case OP_INSERT0:
+						ch->state = NOP;
+						if (upload_cancelled(ch, 0)) {
+							break;
+						}
+						invalidate_tracks(0);
+						floppy0_current_cylinder = 0;
+						clear_write_back(&write_backs[0]);
+						GPIOC->BSRR = 0x10000 << FLOP0_TRK0;
+						GPIOC->BSRR = 1 << ENA0;
+						break;
+					case OP_INSERT1:
+						ch->state = NOP;
+						if (upload_cancelled(ch, 1)) {
+							break;
+						}
+						invalidate_tracks(1);
+						floppy1_current_cylinder = 0;
+						clear_write_back(&write_backs[1]);
+						GPIOA->BSRR = 0x10000 << FLOP1_TRK0;
+						GPIOC->BSRR = 1 << ENA1;
+						break;
+					case OP_INSERT2:
+						ch->state = NOP;
+						if (upload_cancelled(ch, 2)) {
+							break;
+						}
+						invalidate_tracks(2);
+						floppy2_current_cylinder = 0;
+						clear_write_back(&write_backs[2]);
+						GPIOA->BSRR = 0x10000 << FLOP2_TRK0;
+						GPIOA->BSRR = 1 << ENA2;
+						break;
+					case OP_INSERT3:
+						ch->state = NOP;
+						if (upload_cancelled(ch, 3)) {
+							break;
+						}
+						invalidate_tracks(3);
+						floppy3_current_cylinder = 0;
+						clear_write_back(&write_backs[3]);
+						GPIOB->BSRR = 0x10000 << FLOP3_TRK0;
+						GPIOA->BSRR = 1 << ENA3;
+						break;
+					case OP_EJECT0:
+						ch->state = NOP;
+						if (!upload_cancelled(ch, 0)) {
+							eject_drive(0);
+						}
+						break;
+					case OP_EJECT1:
+						ch->state = NOP;
+						if (!upload_cancelled(ch, 1)) {
+							eject_drive(1);
+						}
+						break;
+					case OP_EJECT2:
+						ch->state = NOP;
+						if (!upload_cancelled(ch, 2)) {
+							eject_drive(2);
+						}
+						break;
+					case OP_EJECT3:
+						ch->state = NOP;
+						if (!upload_cancelled(ch, 3)) {
+							eject_drive(3);
+						}
+						break;
+					case OP_FILL0:
+						ch->state = TRANSMIT;
+						ch->fill_ptr = (unsigned char *) floppy0_data;
+						break;
+					case OP_FILL1:
+						ch->state = TRANSMIT;
+						ch->fill_ptr = (unsigned char *) floppy1_data;
+						break;
+					case OP_FILL2:
+						ch->state = TRANSMIT;
+						ch->fill_ptr = (unsigned char *) floppy2_data;
+						break;
+					case OP_FILL3:
+						ch->state = TRANSMIT;
+						ch->fill_ptr = (unsigned char *) floppy3_data;
+						break;
+					case OP_WPROT0:
+						ch->state = NOP;
+						floppy0_write_protected = 1;
+						break;
+					case OP_WPROT1:
+						ch->state = NOP;
+						floppy1_write_protected = 1;
+						break;
+					case OP_WPROT2:
+						ch->state = NOP;
+						floppy2_write_protected = 1;
+						break;
+					case OP_WPROT3:
+						ch->state = NOP;
+						floppy3_write_protected = 1;
+						break;
+					case OP_WUNPROT0:
+						ch->state = NOP;
+						floppy0_write_protected = 0;
+						break;
+					case OP_WUNPROT1:
+						ch->state = NOP;
+						floppy1_write_protected = 0;
+						break;
+					case OP_WUNPROT2:
+						ch->state = NOP;
+						floppy2_write_protected = 0;
+						break;
+					case OP_WUNPROT3:
+						ch->state = NOP;
+						floppy3_write_protected = 0;
+						break;
+					case OP_TYPE0_ADF:
+						ch->state = NOP;
+						floppy_type &= ~0x01;
+						break;
+					case OP_TYPE1_ADF:
+						ch->state = NOP;
+						floppy_type &= ~0x02;
+						break;
+					case OP_TYPE2_ADF:
+						ch->state = NOP;
+						floppy_type &= ~0x04;
+						break;
+					case OP_TYPE3_ADF:
+						ch->state = NOP;
+						floppy_type &= ~0x08;
+						break;
+					case OP_TYPE0_RAW:
+						ch->state = NOP;
+						floppy_type |= 0x01;
+						break;
+					case OP_TYPE1_RAW:
+						ch->state = NOP;
+						floppy_type |= 0x02;
+						break;
+					case OP_TYPE2_RAW:
+						ch->state = NOP;
+						floppy_type |= 0x04;
+						break;
+					case OP_TYPE3_RAW:
+						ch->state = NOP;
+						floppy_type |= 0x08;
+						break;
+					case OP_DELAY0:
+						ch->state = ARGS;
+						ch->op = c;
+						ch->argc = 0;
+						ch->delay_ptr = &floppy0_read_delay;
+						break;
+					case OP_DELAY1:
+						ch->state = ARGS;
+						ch->op = c;
+						ch->argc = 0;
+						ch->delay_ptr = &floppy1_read_delay;
+						break;
+					case OP_DELAY2:
+						ch->state = ARGS;
+						ch->op = c;
+						ch->argc = 0;
+						ch->delay_ptr = &floppy2_read_delay;
+						break;
+					case OP_DELAY3:
+						ch->state = ARGS;
+						ch->op = c;
+						ch->argc = 0;
+						ch->delay_ptr = &floppy3_read_delay;
+						break;
+					case OP_GET_STATS:
+						ch->state = NOP;
+						stats_requested = (1 << INFO_CACHE_STATS) | (1 << INFO_WRITE_BACK_STATS) | (1 << INFO_FLUX_HISTOGRAM);
+						break;
+					case OP_ACK:
+					case OP_RESYNC:
+					case OP_POLICY:
+					case OP_BULK:
+					case OP_UPLOAD:
+						ch->state = ARGS;
+						ch->op = c;
+						ch->argc = 0;
+						break;
+					case OP_SETUP_WIFI:
+						wifi_setup = 1;
+						break;
+					default:
+						// error: unknown operation
+						break;
+				}
+			}
+		}
+	}
+}
+
 int main()
 {
-	State rx_state = NOP;
-	int floppy0_encoded_cylinder = -1;
-	int floppy1_encoded_cylinder = -1;
-	int floppy2_encoded_cylinder = -1;
-	int floppy3_encoded_cylinder = -1;
-	char rx_buffer[64];
-	char tx_buffer[64];
-	unsigned char *floppy_fill_ptr = (unsigned char *) -1;
+	char *tx_buffer;						// frame being prepared
+	char *frame;
+	int tx_frames_ready = 0;
+	Channel *ch;
 	unsigned int tt = 0xffffffff;
-	int track_size;
+	char *tx_track = 0;
+	int tx_drive;
+	Write_back *wb;
+	unsigned int tx_sectors = 0;
 	char *tx_ptr = 0;
 	char *tx_end = 0;
 	int tx_pending = 0;
-	int wifi_setup = 0;
+	int track;
+	int cylinder;
+	int head;
 	int c = 0;
 	int i;
 
@@ -1040,6 +2105,11 @@ int main()
 	GPIOC->BSRR = 1<<LED_RED | 1<<LED_BLUE | 1<<LED_GREEN;
 	GPIOD->BSRR = 1<<LED_YELLOW;
 
+	// Empty track pool
+	for (i = 0; i < TRACK_POOL_SIZE; i++) {
+		track_pool[i].drive = -1;
+	}
+
 	// Setup clocks
 	RCC->CR |= RCC_CR_HSEON;
 	while (!(RCC->CR & RCC_CR_HSERDY));
@@ -1117,6 +2187,15 @@ int main()
 	TIM3->CR1 = TIM_CR1_CEN;
 	NVIC_EnableIRQ(TIM3_IRQn);
 
+	// Setup TIM7 - INDEX period while writing
+	RCC->APB1ENR |= RCC_APB1ENR_TIM7EN;
+	TIM7->PSC = TIM_PCLK1 / TIM7_FREQ - 1;
+	TIM7->ARR = TIM7_FREQ / 1000 * TRACK_PERIOD_US / 1000 - 1;
+	TIM7->EGR = TIM_EGR_UG;						// Load PSC
+	TIM7->SR = 0;
+	TIM7->DIER = TIM_DIER_UIE;
+	NVIC_EnableIRQ(TIM7_IRQn);
+
 	// Setup FMC
 	RCC->AHB3ENR |= RCC_AHB3ENR_FMCEN;
 	setup_pin(B, SDCKE1, 2, 3, 12);
@@ -1162,17 +2241,21 @@ int main()
 	// Re-setup TIM6 - 100 us timer
 	TIM6->ARR = TIM6_FREQ / 10000 - 1;
 
-	// Setup TIM4 - MFM signal generator
+	// Setup TIM4 & DMA1 - MFM signal generator (TIM4_UP: DMA1 stream 6, channel 2)
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
 	RCC->APB1ENR |= RCC_APB1ENR_TIM4EN;
 	setup_pin(D, DKRD, 2, 2, 2);					// TIM4_CH1
 	TIM4->PSC = TIM_PCLK1 / TIM4_FREQ - 1;
 	TIM4->ARR = dkrd_tim_arr_lut[0];
 	TIM4->CCR1 = 1;
 	TIM4->CCER = TIM_CCER_CC1P | TIM_CCER_CC1E;
-	TIM4->DIER = TIM_DIER_UIE;
+	TIM4->DIER = TIM_DIER_UDE;
 	TIM4->CCMR1 = 4 << TIM_CCMR1_OC1M_Pos;				// Force inactive level
 	TIM4->CCMR1 = 6 << TIM_CCMR1_OC1M_Pos;				// PWM mode 1 (active when CNT<CCR1)
+	DMA1_Stream6->PAR = (uint32_t) &TIM4->ARR;
+	DMA1_Stream6->M0AR = (uint32_t) dkrd_dma_buffer;
 	NVIC_EnableIRQ(TIM4_IRQn);
+	NVIC_EnableIRQ(DMA1_Stream6_IRQn);
 
 	// Setup TIM8 - MFM signal scanner
 	RCC->APB2ENR |= RCC_APB2ENR_TIM8EN;
@@ -1182,18 +2265,26 @@ int main()
 	TIM8->SMCR = (5 << TIM_SMCR_TS_Pos) | (4 << TIM_SMCR_SMS_Pos);
 	TIM8->CCMR1 = 1 << TIM_CCMR1_CC1S_Pos;				// IC1 -> TI1
 	TIM8->CCER = TIM_CCER_CC1P | TIM_CCER_CC1E;			// TI1FP1 falling edge
-	TIM8->DIER = TIM_DIER_CC1IE;
-	NVIC_EnableIRQ(TIM8_CC_IRQn);
+	TIM8->DIER = TIM_DIER_CC1DE;
 
-	// Setup EXTI interrupts (SEL0:G3, SEL1:G6, SEL2:D4, SEL3:D5, STEP:G7, SIDE:D11, DKWEB:D13)
+	// Setup DMA2 - MFM signal scanner capture ring (TIM8_CH1: DMA2 stream 2, channel 7)
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+	DMA2_Stream2->PAR = (uint32_t) &TIM8->CCR1;
+	DMA2_Stream2->M0AR = (uint32_t) write_flux_buffer;
+	DMA2_Stream2->NDTR = WRITE_FLUX_SIZE;
+	DMA2_Stream2->CR = (7 << DMA_SxCR_CHSEL_Pos) | (1 << DMA_SxCR_MSIZE_Pos) | (1 << DMA_SxCR_PSIZE_Pos) |
+		DMA_SxCR_MINC | DMA_SxCR_CIRC | (0 << DMA_SxCR_DIR_Pos) | DMA_SxCR_HTIE | DMA_SxCR_TCIE | DMA_SxCR_EN;
+	NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+
+	// Setup EXTI interrupts (SEL0:G3, SEL1:G6, SEL2:D4, SEL3:D5, STEP:G7, SIDE:D11, DKWEB:D13, MREQ:G14)
 	RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
 	SYSCFG->EXTICR[0] = 0x6000;		// PG3
 	SYSCFG->EXTICR[1] = 0x6633;		// PG7, PG6, PD5, PD4
 	SYSCFG->EXTICR[2] = 0x3000;		// PD11
-	SYSCFG->EXTICR[3] = 0x0030;		// PD13
-	EXTI->IMR = (1 << SEL0) | (1 << SEL1) | (1 << STEP) | (1 << DKWEB) | (1 << SIDE) | EXTI_SEL23_MSK;
-	EXTI->RTSR = (1 << SEL0) | (1 << SEL1) | (1 << STEP) | (1 << DKWEB) | (1 << SIDE) | EXTI_SEL23_MSK;
-	EXTI->FTSR = (1 << SEL0) | (1 << SEL1) | (1 << DKWEB) | (1 << SIDE) | EXTI_SEL23_MSK;
+	SYSCFG->EXTICR[3] = 0x0630;		// PG14, PD13
+	EXTI->IMR = (1 << SEL0) | (1 << SEL1) | (1 << STEP) | (1 << DKWEB) | (1 << SIDE) | (1 << MREQ) | EXTI_SEL23_MSK;
+	EXTI->RTSR = (1 << SEL0) | (1 << SEL1) | (1 << STEP) | (1 << DKWEB) | (1 << SIDE) | (1 << MREQ) | EXTI_SEL23_MSK;
+	EXTI->FTSR = (1 << SEL0) | (1 << SEL1) | (1 << DKWEB) | (1 << SIDE) | (1 << MREQ) | EXTI_SEL23_MSK;
 	NVIC_EnableIRQ(EXTI3_IRQn);
 	NVIC_EnableIRQ(EXTI4_IRQn);
 	NVIC_EnableIRQ(EXTI9_5_IRQn);
@@ -1224,72 +2315,84 @@ int main()
 	SPI4->CR2 = SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN;
 	SPI4->CR1 = SPI_CR1_SPE;
 
-	// Prepare track buffers
-	for (i = MFM_TRACK_SIZE; i < MFM_TRACK_SIZE+MFM_GAP_SIZE; i++) {
-		mfm_track_floppy0_head0[i] = 0xaaaaaaaa;
-		mfm_track_floppy0_head1[i] = 0xaaaaaaaa;
-		mfm_track_floppy1_head0[i] = 0xaaaaaaaa;
-		mfm_track_floppy1_head1[i] = 0xaaaaaaaa;
-		mfm_track_floppy2_head0[i] = 0xaaaaaaaa;
-		mfm_track_floppy2_head1[i] = 0xaaaaaaaa;
-		mfm_track_floppy3_head0[i] = 0xaaaaaaaa;
-		mfm_track_floppy3_head1[i] = 0xaaaaaaaa;
-	}
-
 	GPIOC->BSRR = 0x10000 << LED_GREEN;
 
 	for (;;) {
-		if ((GPIOC->ODR & (1 << ENA0)) && (floppy0_encoded_cylinder != floppy0_current_cylinder)) {
-			floppy0_encoded_cylinder = floppy0_current_cylinder;
-			if (floppy_type & 0x01) {
-				i = floppy0_current_cylinder * 2 * RAW_TRACK_SIZE;
-				encode_raw_track(floppy0_data + i, mfm_track_floppy0_head0, EMPTY_TRACK_MASK_FLOPPY0_HEAD0);
-				encode_raw_track(floppy0_data + i + RAW_TRACK_SIZE, mfm_track_floppy0_head1, EMPTY_TRACK_MASK_FLOPPY0_HEAD1);
-			} else {
-				i = floppy0_current_cylinder * 2 * ADF_TRACK_SIZE;
-				encode_mfm_track(floppy0_data + i, mfm_track_floppy0_head0, floppy0_current_cylinder, 0, EMPTY_TRACK_MASK_FLOPPY0_HEAD0);
-				encode_mfm_track(floppy0_data + i + ADF_TRACK_SIZE, mfm_track_floppy0_head1, floppy0_current_cylinder, 1, EMPTY_TRACK_MASK_FLOPPY0_HEAD1);
+		drain_write_flux();
+
+		// Encode the selected head first, the other one when idle
+		if ((GPIOC->ODR & (1 << ENA0)) && !seeking(floppy0_step_time, floppy0_step_interval)) {
+			cylinder = floppy0_current_cylinder;
+			head = selected_drive() == 0 && !(GPIOD->IDR & (1 << SIDE));
+			if (find_track(0, cylinder, head) && !read_start_pending) {
+				head = !head;
+			}
+			if (!find_track(0, cylinder, head)) {
+				encode_track(0, floppy0_data, floppy_type & 0x01, cylinder, head);
 			}
 		}
-		if ((GPIOC->ODR & (1 << ENA1)) && (floppy1_encoded_cylinder != floppy1_current_cylinder)) {
-			floppy1_encoded_cylinder = floppy1_current_cylinder;
-			if (floppy_type & 0x02) {
-				i = floppy1_current_cylinder * 2 * RAW_TRACK_SIZE;
-				encode_raw_track(floppy1_data + i, mfm_track_floppy1_head0, EMPTY_TRACK_MASK_FLOPPY1_HEAD0);
-				encode_raw_track(floppy1_data + i + RAW_TRACK_SIZE, mfm_track_floppy1_head1, EMPTY_TRACK_MASK_FLOPPY1_HEAD1);
-			} else {
-				i = floppy1_current_cylinder * 2 * ADF_TRACK_SIZE;
-				encode_mfm_track(floppy1_data + i, mfm_track_floppy1_head0, floppy1_current_cylinder, 0, EMPTY_TRACK_MASK_FLOPPY1_HEAD0);
-				encode_mfm_track(floppy1_data + i + ADF_TRACK_SIZE, mfm_track_floppy1_head1, floppy1_current_cylinder, 1, EMPTY_TRACK_MASK_FLOPPY1_HEAD1);
+		if ((GPIOC->ODR & (1 << ENA1)) && !seeking(floppy1_step_time, floppy1_step_interval)) {
+			cylinder = floppy1_current_cylinder;
+			head = selected_drive() == 1 && !(GPIOD->IDR & (1 << SIDE));
+			if (find_track(1, cylinder, head) && !read_start_pending) {
+				head = !head;
+			}
+			if (!find_track(1, cylinder, head)) {
+				encode_track(1, floppy1_data, floppy_type & 0x02, cylinder, head);
 			}
 		}
-		if ((GPIOA->ODR & (1 << ENA2)) && (floppy2_encoded_cylinder != floppy2_current_cylinder)) {
-			floppy2_encoded_cylinder = floppy2_current_cylinder;
-			if (floppy_type & 0x04) {
-				i = floppy2_current_cylinder * 2 * RAW_TRACK_SIZE;
-				encode_raw_track(floppy2_data + i, mfm_track_floppy2_head0, EMPTY_TRACK_MASK_FLOPPY2_HEAD0);
-				encode_raw_track(floppy2_data + i + RAW_TRACK_SIZE, mfm_track_floppy2_head1, EMPTY_TRACK_MASK_FLOPPY2_HEAD1);
-			} else {
-				i = floppy2_current_cylinder * 2 * ADF_TRACK_SIZE;
-				encode_mfm_track(floppy2_data + i, mfm_track_floppy2_head0, floppy2_current_cylinder, 0, EMPTY_TRACK_MASK_FLOPPY2_HEAD0);
-				encode_mfm_track(floppy2_data + i + ADF_TRACK_SIZE, mfm_track_floppy2_head1, floppy2_current_cylinder, 1, EMPTY_TRACK_MASK_FLOPPY2_HEAD1);
+		if ((GPIOA->ODR & (1 << ENA2)) && !seeking(floppy2_step_time, floppy2_step_interval)) {
+			cylinder = floppy2_current_cylinder;
+			head = selected_drive() == 2 && !(GPIOD->IDR & (1 << SIDE));
+			if (find_track(2, cylinder, head) && !read_start_pending) {
+				head = !head;
+			}
+			if (!find_track(2, cylinder, head)) {
+				encode_track(2, floppy2_data, floppy_type & 0x04, cylinder, head);
 			}
 		}
-		if ((GPIOA->ODR & (1 << ENA3)) && (floppy3_encoded_cylinder != floppy3_current_cylinder)) {
-			floppy3_encoded_cylinder = floppy3_current_cylinder;
-			if (floppy_type & 0x08) {
-				i = floppy3_current_cylinder * 2 * RAW_TRACK_SIZE;
-				encode_raw_track(floppy3_data + i, mfm_track_floppy3_head0, EMPTY_TRACK_MASK_FLOPPY3_HEAD0);
-				encode_raw_track(floppy3_data + i + RAW_TRACK_SIZE, mfm_track_floppy3_head1, EMPTY_TRACK_MASK_FLOPPY3_HEAD1);
-			} else {
-				i = floppy3_current_cylinder * 2 * ADF_TRACK_SIZE;
-				encode_mfm_track(floppy3_data + i, mfm_track_floppy3_head0, floppy3_current_cylinder, 0, EMPTY_TRACK_MASK_FLOPPY3_HEAD0);
-				encode_mfm_track(floppy3_data + i + ADF_TRACK_SIZE, mfm_track_floppy3_head1, floppy3_current_cylinder, 1, EMPTY_TRACK_MASK_FLOPPY3_HEAD1);
+		if ((GPIOA->ODR & (1 << ENA3)) && !seeking(floppy3_step_time, floppy3_step_interval)) {
+			cylinder = floppy3_current_cylinder;
+			head = selected_drive() == 3 && !(GPIOD->IDR & (1 << SIDE));
+			if (find_track(3, cylinder, head) && !read_start_pending) {
+				head = !head;
 			}
+			if (!find_track(3, cylinder, head)) {
+				encode_track(3, floppy3_data, floppy_type & 0x08, cylinder, head);
+			}
+		}
+
+		// Fill the SDRAM caches of inserted ADF images while idle
+		if (!read_start_pending) {
+			if ((GPIOC->ODR & (1 << ENA0)) && !(floppy_type & 0x01) && sdram_caches[0].fill < SDRAM_CACHE_SLOTS) {
+				fill_sdram_cache(0, floppy0_data);
+			} else if ((GPIOC->ODR & (1 << ENA1)) && !(floppy_type & 0x02) && sdram_caches[1].fill < SDRAM_CACHE_SLOTS) {
+				fill_sdram_cache(1, floppy1_data);
+			} else if ((GPIOA->ODR & (1 << ENA2)) && !(floppy_type & 0x04) && sdram_caches[2].fill < SDRAM_CACHE_SLOTS) {
+				fill_sdram_cache(2, floppy2_data);
+			} else if ((GPIOA->ODR & (1 << ENA3)) && !(floppy_type & 0x08) && sdram_caches[3].fill < SDRAM_CACHE_SLOTS) {
+				fill_sdram_cache(3, floppy3_data);
+			}
+		}
+
+		__disable_irq();
+		if (read_start_pending && mfm_track_ready()) {
+			read_start_pending = 0;
+			TIM5->EGR = TIM_EGR_UG;				// Track is ready, start sending
+		}
+		__enable_irq();
+
+		__disable_irq();
+		if (esp_state == ESP_READY) {
+			esp_state = ESP_IDLE;
 		}
+		__enable_irq();
 
-		if (!tx_pending) {
-			for (i = 1; i < sizeof(tx_buffer);) {
+		// Prepare frames for the next burst, up to the first one without data
+		while (esp_state == ESP_IDLE && tx_frames_ready < ESP_BURST_FRAMES) {
+			tx_buffer = &tx_frames[tx_frames_ready * ESP_FRAME_SIZE];
+			tx_pending = 0;
+			for (i = 1; i < ESP_FRAME_SIZE;) {
 				if (tx_ptr < tx_end) {
 					tx_pending = 1;
 					switch (c = slip_encode(*tx_ptr)) {
@@ -1306,303 +2409,142 @@ int main()
 							break;
 					}
 				} else {
-					if (wifi_setup) {
+					if (tx_sectors) {
+						// Next sector of a sector frame
+						tx_pending = 1;
+						c = __builtin_ctz(tx_sectors);
+						tx_sectors &= tx_sectors - 1;
+						tx_ptr = tx_track + c * 512;
+						tx_end = tx_ptr + 512;
+					} else if (wifi_setup) {
 						wifi_setup = 0;
 						for (tx_ptr = (char *) &wifi_parameters; tx_ptr < (char *) &wifi_parameters + sizeof(struct wifi_parameters); tx_ptr++) {
 							tx_buffer[i++] = *tx_ptr;
 						}
 						tx_ptr = tx_end;
-					} else if (i < sizeof(tx_buffer)-4 && floppy0_dirty_tt_ri != floppy0_dirty_tt_wi) {
-						// Start encoding track from floppy 0
+					} else if (i < ESP_FRAME_SIZE-4 && (stats_requested & (1 << INFO_CACHE_STATS))) {
+						stats_requested &= ~(1 << INFO_CACHE_STATS);
 						tx_pending = 1;
-						tt = floppy0_dirty_tts[floppy0_dirty_tt_ri++ & (MAX_DIRTY_TTS-1)];
-						track_size = (floppy_type & 0x01) ? RAW_TRACK_SIZE : ADF_TRACK_SIZE;
-						tx_ptr = (char *) &floppy0_data[tt * track_size];
-						tx_end = tx_ptr + track_size*4;
+						for (c = 0; c < 4; c++) {
+							info_frame_data[c*2] = sdram_caches[c].hits;
+							info_frame_data[c*2+1] = sdram_caches[c].misses;
+						}
+						tx_ptr = (char *) info_frame_data;
+						tx_end = tx_ptr + 8*4;
 						tx_buffer[i++] = END;
-						tx_buffer[i++] = 0;				// drive number
-						switch (c = slip_encode(tt)) {
-							case -ESC:
-								tx_buffer[i++] = ESC;
-								tx_buffer[i++] = slip_encode(tt);
-								break;
-							case -1:
-								tx_buffer[i++] = 0;
-								tx_ptr = tx_end;
-								break;
-							default:
-								tx_buffer[i++] = c;
-								break;
+						tx_buffer[i++] = INFO_FRAME;
+						tx_buffer[i++] = INFO_CACHE_STATS;
+						tx_buffer[i++] = 8*4;
+					} else if (i < ESP_FRAME_SIZE-4 && (stats_requested & (1 << INFO_WRITE_BACK_STATS))) {
+						stats_requested &= ~(1 << INFO_WRITE_BACK_STATS);
+						tx_pending = 1;
+						for (c = 0; c < 4; c++) {
+							// Queue depth, age of the oldest dirty track [ms], tracks sent,
+							// sectors dropped on header & data checksum errors, tracks lost
+							info_frame_data[c*6] = dirty_track_count(&write_backs[c], &track, &info_frame_data[c*6+1], ticks);
+							info_frame_data[c*6+1] /= 10;
+							info_frame_data[c*6+2] = write_backs[c].sent_tracks;
+							info_frame_data[c*6+3] = write_backs[c].header_errors;
+							info_frame_data[c*6+4] = write_backs[c].data_errors;
+							info_frame_data[c*6+5] = write_backs[c].lost_tracks;
 						}
-					} else if (i < sizeof(tx_buffer)-4 && floppy1_dirty_tt_ri != floppy1_dirty_tt_wi) {
-						// Start encoding track from floppy 1
+						tx_ptr = (char *) info_frame_data;
+						tx_end = tx_ptr + 24*4;
+						tx_buffer[i++] = END;
+						tx_buffer[i++] = INFO_FRAME;
+						tx_buffer[i++] = INFO_WRITE_BACK_STATS;
+						tx_buffer[i++] = 24*4;
+					} else if (i < ESP_FRAME_SIZE-4 && (stats_requested & (1 << INFO_FLUX_HISTOGRAM))) {
+						stats_requested &= ~(1 << INFO_FLUX_HISTOGRAM);
 						tx_pending = 1;
-						tt = floppy1_dirty_tts[floppy1_dirty_tt_ri++ & (MAX_DIRTY_TTS-1)];
-						track_size = (floppy_type & 0x02) ? RAW_TRACK_SIZE : ADF_TRACK_SIZE;
-						tx_ptr = (char *) &floppy1_data[tt * track_size];
-						tx_end = tx_ptr + track_size*4;
+						tx_ptr = (char *) &flux_stats;
+						tx_end = tx_ptr + sizeof(flux_stats);
 						tx_buffer[i++] = END;
-						tx_buffer[i++] = 1;				// drive number
-						switch (c = slip_encode(tt)) {
-							case -ESC:
-								tx_buffer[i++] = ESC;
-								tx_buffer[i++] = slip_encode(tt);
-								break;
-							case -1:
-								tx_buffer[i++] = 0;
-								tx_ptr = tx_end;
-								break;
-							default:
-								tx_buffer[i++] = c;
-								break;
-						}
-					} else if (i < sizeof(tx_buffer)-4 && floppy2_dirty_tt_ri != floppy2_dirty_tt_wi) {
-						// Start encoding track from floppy 2
+						tx_buffer[i++] = INFO_FRAME;
+						tx_buffer[i++] = INFO_FLUX_HISTOGRAM;
+						tx_buffer[i++] = sizeof(flux_stats);
+					} else if (i < ESP_FRAME_SIZE-4 && bulk_error_ri != bulk_error_wi) {
 						tx_pending = 1;
-						tt = floppy2_dirty_tts[floppy2_dirty_tt_ri++ & (MAX_DIRTY_TTS-1)];
-						track_size = (floppy_type & 0x04) ? RAW_TRACK_SIZE : ADF_TRACK_SIZE;
-						tx_ptr = (char *) &floppy2_data[tt * track_size];
-						tx_end = tx_ptr + track_size*4;
+						tx_ptr = (char *) &bulk_errors[bulk_error_ri++ & (BULK_ERROR_QUEUE-1)];
+						tx_end = tx_ptr + sizeof(Bulk_error);
 						tx_buffer[i++] = END;
-						tx_buffer[i++] = 2;				// drive number
-						switch (c = slip_encode(tt)) {
-							case -ESC:
-								tx_buffer[i++] = ESC;
-								tx_buffer[i++] = slip_encode(tt);
-								break;
-							case -1:
-								tx_buffer[i++] = 0;
-								tx_ptr = tx_end;
-								break;
-							default:
-								tx_buffer[i++] = c;
-								break;
-						}
-					} else if (i < sizeof(tx_buffer)-4 && floppy3_dirty_tt_ri != floppy3_dirty_tt_wi) {
-						// Start encoding track from floppy 3
+						tx_buffer[i++] = INFO_FRAME;
+						tx_buffer[i++] = INFO_BULK_ERROR;
+						tx_buffer[i++] = sizeof(Bulk_error);
+					} else if (i < ESP_FRAME_SIZE-10 && (tx_drive = next_write_back(&tt)) >= 0) {
+						// Start sending a written track
 						tx_pending = 1;
-						tt = floppy3_dirty_tts[floppy3_dirty_tt_ri++ & (MAX_DIRTY_TTS-1)];
-						track_size = (floppy_type & 0x08) ? RAW_TRACK_SIZE : ADF_TRACK_SIZE;
-						tx_ptr = (char *) &floppy3_data[tt * track_size];
-						tx_end = tx_ptr + track_size*4;
+						wb = &write_backs[tx_drive];
 						tx_buffer[i++] = END;
-						tx_buffer[i++] = 3;				// drive number
-						switch (c = slip_encode(tt)) {
-							case -ESC:
-								tx_buffer[i++] = ESC;
-								tx_buffer[i++] = slip_encode(tt);
-								break;
-							case -1:
-								tx_buffer[i++] = 0;
-								tx_ptr = tx_end;
-								break;
-							default:
-								tx_buffer[i++] = c;
-								break;
+						if (floppy_type & (1 << tx_drive)) {
+							tx_ptr = (char *) &drive_data(tx_drive)[tt * RAW_TRACK_SIZE];
+							tx_end = tx_ptr + RAW_TRACK_SIZE*4;
+							tx_sectors = 0;
+							tx_buffer[i++] = tx_drive;
+							i += slip_append(&tx_buffer[i], tt);
+							i += slip_append(&tx_buffer[i], wb->generations[tt]);
+						} else {
+							tx_ptr = tx_end = tx_track = (char *) &drive_data(tx_drive)[tt * ADF_TRACK_SIZE];
+							tx_sectors = wb->dirty_sectors[tt];
+							tx_buffer[i++] = SECTOR_FRAME | tx_drive;
+							i += slip_append(&tx_buffer[i], tt);
+							i += slip_append(&tx_buffer[i], wb->generations[tt]);
+							i += slip_append(&tx_buffer[i], tx_sectors);
+							i += slip_append(&tx_buffer[i], tx_sectors >> 8);
 						}
+						sent_dirty_track(wb, tt);
 					} else {
 						tx_buffer[i++] = 0;
 					}
 				}
 			}
 			tx_buffer[0] = tx_pending;
+			if (!tx_pending) {
+				break;
+			}
+			tx_frames_ready++;
 		}
 		GPIOC->BSRR = ((tx_ptr != tx_end) ? 0x10000 : 1) << LED_BLUE;
 
-		if ((GPIOG->IDR & (1 << MREQ))) {
+		__disable_irq();
+		if (esp_state == ESP_IDLE) {
+			esp_state = ESP_READY;
+			// The ESP8266 must have seen SREQ low after the last burst before it is raised again
+			if ((GPIOG->IDR & (1 << MREQ)) ||
+					(tx_frames_ready && ticks - esp_done_time >= ESP_ATTENTION_DELAY)) {
+				esp_arm();
+			}
+		}
+		__enable_irq();
+
+		if (esp_state == ESP_DONE) {
 			GPIOC->BSRR = 0x10000 << LED_RED;
-			tx_pending = 0;
-			esp_transaction(tx_buffer, rx_buffer);
-			for (i = 0; i < sizeof(rx_buffer); i++) {
-				// Process next byte from input buffer
-				c = slip_decode(rx_buffer[i]);
-				if (c == -END) {
-					rx_state = OP;
-				} else if (c > -1) {
-					if (rx_state == TRANSMIT) {
-						*floppy_fill_ptr++ = c;
-						sdram_exit_low_power_mode();
-					} else if (rx_state == NOP) {
-						// pass
-					} else if (rx_state == OP) {
-						switch (c) {
-							case OP_NOP:
-								rx_state = NOP;
-								break;
-							case OP_INSERT0:
-								rx_state = NOP;
-								sdram_exit_low_power_mode();
-								if (floppy_type & 0x01) {
-									encode_raw_track(floppy0_data, mfm_track_floppy0_head0, EMPTY_TRACK_MASK_FLOPPY0_HEAD0);
-									encode_raw_track(floppy0_data + RAW_TRACK_SIZE, mfm_track_floppy0_head1, EMPTY_TRACK_MASK_FLOPPY0_HEAD1);
-								} else {
-									encode_mfm_track(floppy0_data, mfm_track_floppy0_head0, 0, 0, EMPTY_TRACK_MASK_FLOPPY0_HEAD0);
-									encode_mfm_track(floppy0_data + ADF_TRACK_SIZE, mfm_track_floppy0_head1, 0, 1, EMPTY_TRACK_MASK_FLOPPY0_HEAD1);
-								}
-								floppy0_current_cylinder = 0;
-								floppy0_encoded_cylinder = 0;
-								floppy0_dirty_tt_ri = floppy0_dirty_tt_wi;
-								GPIOC->BSRR = 0x10000 << FLOP0_TRK0;
-								GPIOC->BSRR = 1 << ENA0;
-								break;
-							case OP_INSERT1:
-								rx_state = NOP;
-								sdram_exit_low_power_mode();
-								if (floppy_type & 0x02) {
-									encode_raw_track(floppy1_data, mfm_track_floppy1_head0, EMPTY_TRACK_MASK_FLOPPY1_HEAD0);
-									encode_raw_track(floppy1_data + RAW_TRACK_SIZE, mfm_track_floppy1_head1, EMPTY_TRACK_MASK_FLOPPY1_HEAD1);
-								} else {
-									encode_mfm_track(floppy1_data, mfm_track_floppy1_head0, 0, 0, EMPTY_TRACK_MASK_FLOPPY1_HEAD0);
-									encode_mfm_track(floppy1_data + ADF_TRACK_SIZE, mfm_track_floppy1_head1, 0, 1, EMPTY_TRACK_MASK_FLOPPY1_HEAD1);
-								}
-								floppy1_current_cylinder = 0;
-								floppy1_encoded_cylinder = 0;
-								floppy1_dirty_tt_ri = floppy1_dirty_tt_wi;
-								GPIOA->BSRR = 0x10000 << FLOP1_TRK0;
-								GPIOC->BSRR = 1 << ENA1;
-								break;
-							case OP_INSERT2:
-								rx_state = NOP;
-								sdram_exit_low_power_mode();
-								if (floppy_type & 0x04) {
-									encode_raw_track(floppy2_data, mfm_track_floppy2_head0, EMPTY_TRACK_MASK_FLOPPY2_HEAD0);
-									encode_raw_track(floppy2_data + RAW_TRACK_SIZE, mfm_track_floppy2_head1, EMPTY_TRACK_MASK_FLOPPY2_HEAD1);
-								} else {
-									encode_mfm_track(floppy2_data, mfm_track_floppy2_head0, 0, 0, EMPTY_TRACK_MASK_FLOPPY2_HEAD0);
-									encode_mfm_track(floppy2_data + ADF_TRACK_SIZE, mfm_track_floppy2_head1, 0, 1, EMPTY_TRACK_MASK_FLOPPY2_HEAD1);
-								}
-								floppy2_current_cylinder = 0;
-								floppy2_encoded_cylinder = 0;
-								floppy2_dirty_tt_ri = floppy2_dirty_tt_wi;
-								GPIOA->BSRR = 0x10000 << FLOP2_TRK0;
-								GPIOA->BSRR = 1 << ENA2;
-								break;
-							case OP_INSERT3:
-								rx_state = NOP;
-								sdram_exit_low_power_mode();
-								if (floppy_type & 0x08) {
-									encode_raw_track(floppy3_data, mfm_track_floppy3_head0, EMPTY_TRACK_MASK_FLOPPY3_HEAD0);
-									encode_raw_track(floppy3_data + RAW_TRACK_SIZE, mfm_track_floppy3_head1, EMPTY_TRACK_MASK_FLOPPY3_HEAD1);
-								} else {
-									encode_mfm_track(floppy3_data, mfm_track_floppy3_head0, 0, 0, EMPTY_TRACK_MASK_FLOPPY3_HEAD0);
-									encode_mfm_track(floppy3_data + ADF_TRACK_SIZE, mfm_track_floppy3_head1, 0, 1, EMPTY_TRACK_MASK_FLOPPY3_HEAD1);
-								}
-								floppy3_current_cylinder = 0;
-								floppy3_encoded_cylinder = 0;
-								floppy3_dirty_tt_ri = floppy3_dirty_tt_wi;
-								GPIOB->BSRR = 0x10000 << FLOP3_TRK0;
-								GPIOA->BSRR = 1 << ENA3;
-								break;
-							case OP_EJECT0:
-								rx_state = NOP;
-								GPIOC->BSRR = 1 << FLOP0_TRK0;
-								GPIOC->BSRR = 0x10000 << ENA0;
-								break;
-							case OP_EJECT1:
-								rx_state = NOP;
-								GPIOA->BSRR = 1 << FLOP1_TRK0;
-								GPIOC->BSRR = 0x10000 << ENA1;
-								break;
-							case OP_EJECT2:
-								rx_state = NOP;
-								GPIOA->BSRR = 1 << FLOP2_TRK0;
-								GPIOA->BSRR = 0x10000 << ENA2;
-								break;
-							case OP_EJECT3:
-								rx_state = NOP;
-								GPIOB->BSRR = 1 << FLOP3_TRK0;
-								GPIOA->BSRR = 0x10000 << ENA3;
-								break;
-							case OP_FILL0:
-								rx_state = TRANSMIT;
-								floppy_fill_ptr = (unsigned char *) floppy0_data;
-								break;
-							case OP_FILL1:
-								rx_state = TRANSMIT;
-								floppy_fill_ptr = (unsigned char *) floppy1_data;
-								break;
-							case OP_FILL2:
-								rx_state = TRANSMIT;
-								floppy_fill_ptr = (unsigned char *) floppy2_data;
-								break;
-							case OP_FILL3:
-								rx_state = TRANSMIT;
-								floppy_fill_ptr = (unsigned char *) floppy3_data;
-								break;
-							case OP_WPROT0:
-								rx_state = NOP;
-								floppy0_write_protected = 1;
-								break;
-							case OP_WPROT1:
-								rx_state = NOP;
-								floppy1_write_protected = 1;
-								break;
-							case OP_WPROT2:
-								rx_state = NOP;
-								floppy2_write_protected = 1;
-								break;
-							case OP_WPROT3:
-								rx_state = NOP;
-								floppy3_write_protected = 1;
-								break;
-							case OP_WUNPROT0:
-								rx_state = NOP;
-								floppy0_write_protected = 0;
-								break;
-							case OP_WUNPROT1:
-								rx_state = NOP;
-								floppy1_write_protected = 0;
-								break;
-							case OP_WUNPROT2:
-								rx_state = NOP;
-								floppy2_write_protected = 0;
-								break;
-							case OP_WUNPROT3:
-								rx_state = NOP;
-								floppy3_write_protected = 0;
-								break;
-							case OP_TYPE0_ADF:
-								rx_state = NOP;
-								floppy_type &= ~0x01;
-								break;
-							case OP_TYPE1_ADF:
-								rx_state = NOP;
-								floppy_type &= ~0x02;
-								break;
-							case OP_TYPE2_ADF:
-								rx_state = NOP;
-								floppy_type &= ~0x04;
-								break;
-							case OP_TYPE3_ADF:
-								rx_state = NOP;
-								floppy_type &= ~0x08;
-								break;
-							case OP_TYPE0_RAW:
-								rx_state = NOP;
-								floppy_type |= 0x01;
-								break;
-							case OP_TYPE1_RAW:
-								rx_state = NOP;
-								floppy_type |= 0x02;
-								break;
-							case OP_TYPE2_RAW:
-								rx_state = NOP;
-								floppy_type |= 0x04;
-								break;
-							case OP_TYPE3_RAW:
-								rx_state = NOP;
-								floppy_type |= 0x08;
-								break;
-							case OP_SETUP_WIFI:
-								wifi_setup = 1;
-								break;
-							default:
-								// error: unknown operation
-								break;
-						}
-					}
+			c = esp_frames;
+
+			// Frames not clocked out go with the next burst
+			tx_frames_ready = tx_frames_ready > c ? tx_frames_ready - c : 0;
+			for (i = 0; i < tx_frames_ready * ESP_FRAME_SIZE; i++) {
+				tx_frames[i] = tx_frames[i + c * ESP_FRAME_SIZE];
+			}
+			for (i = tx_frames_ready; i < ESP_BURST_FRAMES; i++) {
+				tx_frames[i * ESP_FRAME_SIZE] = 0;
+			}
+
+			// Frames of both channels in the order the ESP8266 sent them
+			for (frame = rx_buffer; frame < rx_buffer + c * ESP_FRAME_SIZE; frame += ESP_FRAME_SIZE) {
+				ch = (frame[0] & FRAME_DATA) ? &data_channel : &control_channel;
+				if (frame[0] & FRAME_RESET) {
+					reset_channel(ch);
 				}
+				process_rx(ch, frame + 1, frame[0] & FRAME_LENGTH);
+			}
+			if (control_channel.state == TRANSMIT || control_channel.state == BULK) {
+				store_fill_data(&control_channel, 0);
+			}
+			if (data_channel.state == TRANSMIT || data_channel.state == BULK) {
+				store_fill_data(&data_channel, 0);
 			}
+			esp_state = ESP_IDLE;
 		} else {
 			GPIOC->BSRR = 1 << LED_RED;
 		}
@@ -0,0 +1,214 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// No device dependencies - this file can also be built and profiled on a host.
+
+#include "mfm.h"
+
+#define INFO		0
+#define LABEL		2
+#define HDR_CHECKSUM	10
+#define DATA_CHECKSUM	12
+#define DATA_ODD	14
+#define DATA_EVEN	(DATA_ODD + 512/4)
+
+unsigned int mfm_checksum(unsigned int *data, int length)
+{
+	unsigned int result = 0;
+	while (length--) {
+		result ^= *data ^ (*data >> 1);
+		data++;
+	}
+	return result & 0x55555555;
+}
+
+static inline unsigned int mfm_encode(unsigned int value, unsigned int prev_bit)
+{
+	unsigned int x = value & 0x55555555;
+	return x | (0xaaaaaaaa & ~((x << 1) | (x >> 1) | prev_bit));
+}
+
+static unsigned int mfm_encode_pair(unsigned int *mfm, unsigned int value, unsigned int prev_bit)
+{
+	mfm[0] = mfm_encode(value >> 1, prev_bit);
+	mfm[1] = mfm_encode(value, value >> 1 << 31);
+	return value << 31;
+}
+
+// Encodes one sector (sync, header & data) reading the user data only once.
+// The data checksum precedes the data, so the data is encoded first and
+// the clock bits depending on the checksum are fixed up afterwards.
+static unsigned int mfm_encode_sector(unsigned int *user_data, unsigned int *mfm, unsigned int info, unsigned int prev_bit)
+{
+	unsigned int *odd = mfm + 2 + DATA_ODD;
+	unsigned int *even = mfm + 2 + DATA_EVEN;
+	unsigned int odd_prev_bit = 0;
+	unsigned int even_prev_bit = 0;
+	unsigned int chksum = 0;
+	unsigned int value;
+	int i;
+
+	*mfm++ = 0xaaaaaaaa ^ prev_bit;
+	*mfm++ = MFM_SYNC;
+
+	// Data & data checksum in a single pass
+	for (i = 0; i < 512/4; i++) {
+		value = __builtin_bswap32(user_data[i]);
+		chksum ^= value ^ (value >> 1);
+		odd[i] = mfm_encode(value >> 1, odd_prev_bit);
+		odd_prev_bit = value >> 1 << 31;
+		even[i] = mfm_encode(value, even_prev_bit);
+		even_prev_bit = value << 31;
+	}
+	if (odd_prev_bit) {
+		even[0] &= 0x7fffffff;
+	}
+
+	// Header
+	prev_bit = mfm_encode_pair(mfm + INFO, info, 0x80000000);
+	for (i = LABEL; i < HDR_CHECKSUM; i++) {
+		mfm[i] = mfm_encode(0, prev_bit);
+		prev_bit = 0;
+	}
+	prev_bit = mfm_encode_pair(mfm + HDR_CHECKSUM, mfm_checksum(&info, 1), prev_bit);
+	prev_bit = mfm_encode_pair(mfm + DATA_CHECKSUM, chksum & 0x55555555, prev_bit);
+	if (prev_bit) {
+		odd[0] &= 0x7fffffff;
+	}
+
+	return even_prev_bit;
+}
+
+int mfm_encode_track(unsigned int *user_data, unsigned int *mfm, int cylinder, int head, const volatile int *target)
+{
+	unsigned int tt = ((cylinder << 1) | head) << 16;
+	unsigned int prev_bit = 0x00000000;
+	int s;
+
+	for (s = 0; s < 11; s++) {
+		if (target && *target != cylinder) {
+			return 0;
+		}
+		prev_bit = mfm_encode_sector(user_data, mfm, 0xff000000 | tt | (s << 8) | (11 - s), prev_bit);
+		user_data += 512/4;
+		mfm += 2 + MFM_SECTOR_SIZE;
+	}
+	*mfm = 0xaaaaaaaa ^ prev_bit;
+	return 1;
+}
+
+static inline unsigned int mfm_decode_pair(unsigned int odd, unsigned int even)
+{
+	return ((odd & 0x55555555) << 1) | (even & 0x55555555);
+}
+
+static void mfm_decode_sector(Mfm_decoder *decoder)
+{
+	unsigned int *mfm = decoder->sector;
+	unsigned int *data;
+	unsigned int info = mfm_decode_pair(mfm[INFO], mfm[INFO+1]);
+	unsigned int sector = (info >> 8) & 0xff;
+	unsigned int value;
+	unsigned int chksum = 0;
+	int changed = 0;
+	int i;
+
+	// Header checksum - equal to mfm_checksum() of the decoded info & label
+	for (i = INFO; i < HDR_CHECKSUM; i++) {
+		chksum ^= mfm[i];
+	}
+	if ((chksum & 0x55555555) != mfm_decode_pair(mfm[HDR_CHECKSUM], mfm[HDR_CHECKSUM+1]) || sector >= 11) {
+		decoder->header_errors++;
+		return;
+	}
+
+	// Data checksum - the staged sector is committed only if it matches
+	chksum = 0;
+	for (i = 0; i < 2*512/4; i++) {
+		chksum ^= mfm[DATA_ODD+i];
+	}
+	if ((chksum & 0x55555555) != mfm_decode_pair(mfm[DATA_CHECKSUM], mfm[DATA_CHECKSUM+1])) {
+		decoder->data_errors++;
+		return;
+	}
+
+	// Data
+	data = decoder->data + sector * 512/4;
+	for (i = 0; i < 512/4; i++) {
+		value = __builtin_bswap32(mfm_decode_pair(mfm[DATA_ODD+i], mfm[DATA_EVEN+i]));
+		if (data[i] != value) {
+			data[i] = value;
+			changed = 1;
+		}
+	}
+
+	decoder->received_sectors |= 1 << sector;
+	if (changed) {
+		decoder->changed_sectors |= 1 << sector;
+	}
+}
+
+void mfm_decoder_init(Mfm_decoder *decoder, unsigned int *data)
+{
+	decoder->data = data;
+	decoder->prev_long = 0;
+	decoder->shift = -1;
+	decoder->count = 0;
+	decoder->received_sectors = 0;
+	decoder->changed_sectors = 0;
+	decoder->header_errors = 0;
+	decoder->data_errors = 0;
+}
+
+void mfm_decode_long(Mfm_decoder *decoder, unsigned int value)
+{
+	unsigned long long window = ((unsigned long long) decoder->prev_long << 32) | value;
+	unsigned int aligned;
+	int s;
+
+	decoder->prev_long = value;
+
+	if (decoder->shift < 0) {
+		// Search for the sync word at every bit offset
+		for (s = 0; s < 32; s++) {
+			if ((unsigned int) (window >> s) == MFM_SYNC) {
+				decoder->shift = s;
+				decoder->count = 0;
+				break;
+			}
+		}
+	} else {
+		aligned = (unsigned int) (window >> decoder->shift);
+		if (decoder->count == 0 && aligned == MFM_SYNC) {
+			// Repeated sync word
+			return;
+		}
+		decoder->sector[decoder->count++] = aligned;
+		if (decoder->count == MFM_SECTOR_SIZE) {
+			mfm_decode_sector(decoder);
+			decoder->shift = -1;
+		}
+	}
+}
+
+void mfm_decode(Mfm_decoder *decoder, unsigned int *mfm, int length)
+{
+	while (length--) {
+		mfm_decode_long(decoder, *mfm++);
+	}
+}
@@ -0,0 +1,113 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host benchmark of mfm.c: encodes and decodes a track, checks that the
+// data comes back unchanged and reports the time per track.
+// Build and run with "make bench".
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mfm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles()	__rdtsc()
+#else
+#define cycles()	0ULL
+#endif
+
+// [long word]
+#define TRACK_SIZE	(11 * (2 + MFM_SECTOR_SIZE) + 1)
+#define ROUNDS		2000
+
+unsigned int user_data[11*512/4];
+unsigned int decoded[11*512/4];
+unsigned int mfm[TRACK_SIZE];
+unsigned int shifted[TRACK_SIZE + 1];
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Decodes the track as written starting shift bits late, returns 0 if it came back
+static int round_trip(int shift)
+{
+	Mfm_decoder decoder;
+	int i;
+
+	shifted[0] = 0xaaaaaaaa >> shift;
+	for (i = 0; i < TRACK_SIZE; i++) {
+		shifted[i] |= shift ? mfm[i] >> shift : mfm[i];
+		shifted[i+1] = shift ? mfm[i] << (32 - shift) : 0;
+	}
+	memset(decoded, 0, sizeof(decoded));
+	mfm_decoder_init(&decoder, decoded);
+	mfm_decode(&decoder, shifted, TRACK_SIZE + 1);
+	if (decoder.received_sectors != 0x7ff || decoder.header_errors || decoder.data_errors ||
+			memcmp(decoded, user_data, sizeof(user_data))) {
+		printf("shift %2d: received %03x, header errors %u, data errors %u, data %s\n",
+				shift, decoder.received_sectors, decoder.header_errors, decoder.data_errors,
+				memcmp(decoded, user_data, sizeof(user_data)) ? "differs" : "ok");
+		return 1;
+	}
+	return 0;
+}
+
+int main()
+{
+	Mfm_decoder decoder;
+	unsigned long long c0, c1;
+	double t0, t1;
+	int errors = 0;
+	int i;
+
+	for (i = 0; i < 11*512/4; i++) {
+		user_data[i] = i * 2654435761u;
+	}
+	mfm_encode_track(user_data, mfm, 40, 1, 0);
+	for (i = 0; i < 32; i++) {
+		errors += round_trip(i);
+	}
+
+	t0 = now();
+	c0 = cycles();
+	for (i = 0; i < ROUNDS; i++) {
+		mfm_encode_track(user_data, mfm, 40, 1, 0);
+	}
+	c1 = cycles();
+	t1 = now();
+	printf("encode: %8.0f ns/track, %8llu cycles/track\n", (t1 - t0) * 1e9 / ROUNDS, (c1 - c0) / ROUNDS);
+
+	t0 = now();
+	c0 = cycles();
+	for (i = 0; i < ROUNDS; i++) {
+		mfm_decoder_init(&decoder, decoded);
+		mfm_decode(&decoder, mfm, TRACK_SIZE);
+	}
+	c1 = cycles();
+	t1 = now();
+	printf("decode: %8.0f ns/track, %8llu cycles/track\n", (t1 - t0) * 1e9 / ROUNDS, (c1 - c0) / ROUNDS);
+
+	printf("round trip: %s\n", errors ? "FAILED" : "ok");
+	return errors != 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// No device dependencies - this file can also be built and tested on a host.
+
+#include "write_back.h"
+
+static inline void mark_dirty_track(Write_back *wb, int tt, unsigned int now)
+{
+	if (!(wb->dirty_tracks[tt >> 5] & (1 << (tt & 31)))) {
+		wb->dirty_tracks[tt >> 5] |= 1 << (tt & 31);
+		wb->dirty_since[tt] = now;
+	}
+}
+
+void queue_dirty_track(Write_back *wb, int tt, unsigned int sectors, unsigned int now)
+{
+	// Unacknowledged sectors are sent again with the new generation
+	wb->dirty_sectors[tt] |= sectors | wb->unacked_sectors[tt];
+	wb->unacked_sectors[tt] = 0;
+	wb->generations[tt]++;
+	mark_dirty_track(wb, tt, now);
+}
+
+void sent_dirty_track(Write_back *wb, int tt)
+{
+	wb->unacked_sectors[tt] |= wb->dirty_sectors[tt];
+	wb->dirty_sectors[tt] = 0;
+}
+
+void ack_track(Write_back *wb, int tt, int generation)
+{
+	if (wb->generations[tt] == generation) {
+		wb->unacked_sectors[tt] = 0;
+	}
+}
+
+void resync_write_back(Write_back *wb, unsigned int now)
+{
+	int tt;
+
+	for (tt = 0; tt < DISK_TRACKS; tt++) {
+		if (wb->unacked_sectors[tt]) {
+			wb->dirty_sectors[tt] |= wb->unacked_sectors[tt];
+			wb->unacked_sectors[tt] = 0;
+			mark_dirty_track(wb, tt, now);
+		}
+	}
+}
+
+void clear_write_back(Write_back *wb)
+{
+	int i;
+
+	for (i = 0; i < DISK_TRACKS / 32; i++) {
+		wb->dirty_tracks[i] = 0;
+	}
+	for (i = 0; i < DISK_TRACKS; i++) {
+		wb->dirty_sectors[i] = 0;
+		wb->unacked_sectors[i] = 0;
+	}
+}
+
+int next_dirty_track(Write_back *wb, unsigned int *tt)
+{
+	unsigned int bits;
+	int i;
+	int k;
+
+	for (i = 0; i <= DISK_TRACKS / 32; i++) {
+		k = ((wb->cursor >> 5) + i) % (DISK_TRACKS / 32);
+		bits = wb->dirty_tracks[k];
+		if (i == 0) {
+			bits &= ~0u << (wb->cursor & 31);
+		}
+		if (bits) {
+			*tt = (k << 5) | __builtin_ctz(bits);
+			wb->dirty_tracks[k] &= ~(1 << (*tt & 31));
+			wb->cursor = (*tt + 1) % DISK_TRACKS;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int dirty_track_count(Write_back *wb, int *oldest_tt, unsigned int *age, unsigned int now)
+{
+	unsigned int bits;
+	int count = 0;
+	int tt;
+	int k;
+
+	*age = 0;
+	for (k = 0; k < DISK_TRACKS / 32; k++) {
+		for (bits = wb->dirty_tracks[k]; bits; bits &= bits - 1) {
+			tt = (k << 5) | __builtin_ctz(bits);
+			if (!count++ || now - wb->dirty_since[tt] > *age) {
+				*oldest_tt = tt;
+				*age = now - wb->dirty_since[tt];
+			}
+		}
+	}
+	return count;
+}
@@ -0,0 +1,102 @@
+/*
+ * phloppy_0 - Commodore Amiga floppy drive emulator
+ * Copyright (C) 2016-2018 Piotr Wiszowaty
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host test of write_back.c: written tracks the host never acknowledged,
+// e.g. because the connection dropped, are sent again after OP_RESYNC.
+// Build and run with "make test".
+
+#include <stdio.h>
+#include <string.h>
+#include "write_back.h"
+
+Write_back write_backs[2];
+int failures;
+
+#define CHECK(x)	check(x, #x, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	if (!ok) {
+		printf("line %d: %s failed\n", line, what);
+		failures++;
+	}
+}
+
+// Sends everything dirty like the main loop does, returns the number of tracks
+static int send_all(Write_back *wb, unsigned int *sectors, unsigned char *generations)
+{
+	unsigned int tt;
+	int count = 0;
+
+	while (next_dirty_track(wb, &tt)) {
+		sectors[tt] = wb->dirty_sectors[tt];
+		generations[tt] = wb->generations[tt];
+		sent_dirty_track(wb, tt);
+		count++;
+	}
+	return count;
+}
+
+int main()
+{
+	unsigned int sectors[DISK_TRACKS];
+	unsigned char generations[DISK_TRACKS];
+	unsigned int age;
+	int tt;
+
+	// Two tracks of drive 0 and one of drive 1 written, all sent, none
+	// acknowledged before the host went away
+	queue_dirty_track(&write_backs[0], 5, 0x4c0, 0);
+	queue_dirty_track(&write_backs[0], 81, 0x7ff, 0);
+	queue_dirty_track(&write_backs[1], 3, 0x001, 0);
+	memset(sectors, 0, sizeof(sectors));
+	CHECK(send_all(&write_backs[0], sectors, generations) == 2);
+	CHECK(sectors[5] == 0x4c0 && sectors[81] == 0x7ff);
+	CHECK(send_all(&write_backs[1], sectors, generations) == 1);
+	CHECK(dirty_track_count(&write_backs[0], &tt, &age, 10) == 0);
+
+	// The new host opens drive 0's image and resyncs it: the same sectors
+	// come again with the same generations
+	resync_write_back(&write_backs[0], 10);
+	CHECK(dirty_track_count(&write_backs[1], &tt, &age, 10) == 0);
+	memset(sectors, 0, sizeof(sectors));
+	CHECK(send_all(&write_backs[0], sectors, generations) == 2);
+	CHECK(sectors[5] == 0x4c0 && sectors[81] == 0x7ff);
+	CHECK(generations[5] == 1 && generations[81] == 1);
+
+	// A stale acknowledgement is ignored, the current one is final
+	ack_track(&write_backs[0], 5, 0);
+	ack_track(&write_backs[0], 81, 1);
+	resync_write_back(&write_backs[0], 20);
+	memset(sectors, 0, sizeof(sectors));
+	CHECK(send_all(&write_backs[0], sectors, generations) == 1);
+	CHECK(sectors[5] == 0x4c0 && sectors[81] == 0);
+	ack_track(&write_backs[0], 5, 1);
+	resync_write_back(&write_backs[0], 30);
+	CHECK(dirty_track_count(&write_backs[0], &tt, &age, 30) == 0);
+
+	// Drive 1 kept its unacknowledged track meanwhile. Writing it again
+	// sends the old and the new sectors with the next generation.
+	queue_dirty_track(&write_backs[1], 3, 0x100, 40);
+	memset(sectors, 0, sizeof(sectors));
+	CHECK(send_all(&write_backs[1], sectors, generations) == 1);
+	CHECK(sectors[3] == 0x101 && generations[3] == 2);
+
+	printf("write back: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}
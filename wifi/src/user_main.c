@@ -26,22 +26,78 @@
 
 #define MAIN_PORT	4500
 #define AUX_PORT	4501
+// Image uploads, so that they don't hold up the ops on MAIN_PORT
+#define DATA_PORT	4502
 
 #define MREQ	(1 << 4)
 #define SREQ	(1 << 5)
 
+// Frames to the STM32: FRAME_* header, payload
+// Frames from the STM32: non-zero if there is data, payload
+#define FRAME_SIZE	64
+#define FRAME_PAYLOAD	(FRAME_SIZE - 1)
+#define FRAME_LENGTH	0x3f		// of the payload
+#define FRAME_DATA	0x40		// from the data connection
+#define FRAME_RESET	0x80		// first frame after the data connection was restarted
+// Frames exchanged within one MREQ/SREQ handshake, at most ESP_BURST_FRAMES of the STM32
+#define BURST_FRAMES	16
+
+// [byte] TCP payload the frames from the STM32 are packed into
+#define TX_SEGMENT_SIZE	1400
+// [ms] delay before a partly filled segment is sent
+#define TX_FLUSH_DELAY	2
+// [byte] free RX ring space below which the host is held off. A whole TCP
+// window (TCP_WND) may come with one receive callback after a lost segment.
+#define RX_HOLD_LEVEL	(4 * 1460)
+// [byte] free RX ring space above which the host may send again
+#define RX_UNHOLD_LEVEL	(RX_HOLD_LEVEL + BURST_FRAMES * FRAME_PAYLOAD)
+
+#define PUMP_TASK_PRIO	USER_TASK_PRIO_0
+#define PUMP_QUEUE_LEN	4
+
+// Progress of a burst, pump_task() runs the next step once SREQ allows
+typedef enum {
+	SPI_IDLE,
+	SPI_REQUESTED,					// MREQ raised, waiting for SREQ high
+	SPI_RELEASED,					// frames exchanged, MREQ dropped, waiting for SREQ low
+	SPI_DONE					// frames from the STM32 to be unpacked
+} Spi_state;
+
 struct espconn aux_conn;
 esp_tcp aux_tcp;
 struct espconn main_conn;
 esp_tcp main_tcp;
+struct espconn data_conn;
+esp_tcp data_tcp;
 
 char aux_buffer[80];
 int aux_offset = 0;
-char main_buffer[8192];
-int main_rx_ri;
-int main_rx_wi;
-int main_tx_i;
-char tx_blocked;
+// Host to STM32
+char rx_ring[8192];
+int rx_ri;
+int rx_wi;
+char rx_held;
+char rx_overflow;					// bytes were lost, pump_task() closes the connection
+// Data connection to STM32, sent after rx_ring
+char data_ring[8192];
+int data_ri;
+int data_wi;
+char data_held;
+char data_overflow;
+char data_reset;
+struct espconn *data_client;
+// STM32 to host
+char tx_ring[4096];
+int tx_ri;
+int tx_wi;
+char burst_buffer[BURST_FRAMES * FRAME_SIZE];
+int burst_frames;
+volatile Spi_state spi_state;
+char stm32_pending;					// the last burst ended with data
+os_timer_t tx_flush_timer;
+char tx_flush_armed;
+os_event_t pump_queue[PUMP_QUEUE_LEN];
+struct espconn *main_client;
 
 uint32 ICACHE_FLASH_ATTR
 user_rf_cal_sector_set()
@@ -110,78 +166,245 @@ aux_connect_cb(void *arg)
 			conn->proto.tcp->remote_ip[3], conn->proto.tcp->remote_port);
 }
 
+static inline int
+rx_used()
+{
+	return (rx_wi - rx_ri) & (sizeof(rx_ring) - 1);
+}
+
+static inline int
+data_used()
+{
+	return (data_wi - data_ri) & (sizeof(data_ring) - 1);
+}
+
+static inline int
+tx_used()
+{
+	return (tx_wi - tx_ri) & (sizeof(tx_ring) - 1);
+}
+
+// Sends whole segments, or everything if force is set
 sint8
-comm_main(struct espconn *conn)
+tx_flush(int force)
 {
 	sint8 result = 0;
+	int n;
+
+	if (main_client == NULL) {
+		// Nobody to send to, the STM32 sends written tracks again after OP_RESYNC
+		tx_ri = tx_wi;
+		return 0;
+	}
+	while ((n = tx_used()) >= TX_SEGMENT_SIZE || (force && n > 0)) {
+		if (n > TX_SEGMENT_SIZE) {
+			n = TX_SEGMENT_SIZE;
+		}
+		if (n > sizeof(tx_ring) - tx_ri) {
+			n = sizeof(tx_ring) - tx_ri;
+		}
+		result = espconn_send(main_client, tx_ring + tx_ri, n);
+		if (result < 0) {
+			// Retried from main_sent_cb
+			break;
+		}
+		tx_ri = (tx_ri + n) & (sizeof(tx_ring) - 1);
+	}
+	if (tx_used() && !tx_flush_armed) {
+		tx_flush_armed = 1;
+		os_timer_arm(&tx_flush_timer, TX_FLUSH_DELAY, 0);
+	}
+	return result;
+}
+
+void
+tx_flush_timer_cb(void *arg)
+{
+	tx_flush_armed = 0;
+	tx_flush(1);
+}
+
+static inline void
+pump_post()
+{
+	system_os_post(PUMP_TASK_PRIO, 0, 0);
+}
+
+// Exchanges bursts with the STM32 while there is host data for it or it has
+// data for the host, and the TX ring has room for a burst's worth of data.
+// Data of the main connection goes first, the data connection gets the rest of a burst.
+// Runs as far as SREQ allows, gpio_intr() posts it again on SREQ edges.
+void
+pump_task(os_event_t *event)
+{
+	char *frame;
+	int frames;
+	int length;
+	int n;
+	int d;
 	int i;
+	int k;
 
-	while (main_tx_i != main_rx_ri) {
-		if (main_buffer[main_tx_i]) {
-			//os_printf("tx:%d\r\n", main_tx_i);
-			result = espconn_send(conn, main_buffer + main_tx_i + 1, 63);
-			if (result < 0) {
-				break;
-			} else {
-				/*
-				for (i = 0; i < 64; i++) {
-					os_printf("%02x ", main_buffer[main_tx_i + i]);
+	// Not from the receive callbacks, the SDK doesn't allow it there
+	if (rx_overflow) {
+		rx_overflow = 0;
+		if (main_client != NULL) {
+			espconn_disconnect(main_client);
+		}
+	}
+	if (data_overflow) {
+		data_overflow = 0;
+		if (data_client != NULL) {
+			espconn_disconnect(data_client);
+		}
+	}
+
+	if (spi_state == SPI_IDLE) {
+		// SREQ raised without MREQ - the STM32 has data for the host
+		if (main_client != NULL && (GPIO_REG_READ(GPIO_IN_ADDRESS) & SREQ)) {
+			stm32_pending = 1;
+		}
+		if (sizeof(tx_ring) - 1 - tx_used() < BURST_FRAMES * FRAME_PAYLOAD) {
+			// Posted again from main_sent_cb
+			return;
+		}
+
+		n = rx_used();
+		d = data_used();
+		frames = (n + FRAME_PAYLOAD - 1) / FRAME_PAYLOAD + (d + FRAME_PAYLOAD - 1) / FRAME_PAYLOAD;
+		if (data_reset && d == 0) {
+			frames++;
+		}
+		if (stm32_pending) {
+			frames = BURST_FRAMES;
+		}
+		if (frames == 0) {
+			return;
+		} else if (frames > BURST_FRAMES) {
+			frames = BURST_FRAMES;
+		}
+
+		for (i = 0, frame = burst_buffer; i < frames; i++, frame += FRAME_SIZE) {
+			if (n > 0) {
+				length = n < FRAME_PAYLOAD ? n : FRAME_PAYLOAD;
+				frame[0] = length;
+				for (k = 1; k <= length; k++) {
+					frame[k] = rx_ring[rx_ri];
+					rx_ri = (rx_ri + 1) & (sizeof(rx_ring) - 1);
 				}
-				os_printf("\r\n");
-				*/
-				main_tx_i = (main_tx_i + 64) & (sizeof(main_buffer) - 1);
+				n -= length;
+			} else if (d > 0 || data_reset) {
+				length = d < FRAME_PAYLOAD ? d : FRAME_PAYLOAD;
+				frame[0] = FRAME_DATA | (data_reset ? FRAME_RESET : 0) | length;
+				data_reset = 0;
+				for (k = 1; k <= length; k++) {
+					frame[k] = data_ring[data_ri];
+					data_ri = (data_ri + 1) & (sizeof(data_ring) - 1);
+				}
+				d -= length;
+			} else {
+				frame[0] = 0;
 			}
-		} else {
-			main_tx_i = (main_tx_i + 64) & (sizeof(main_buffer) - 1);
 		}
+		burst_frames = frames;
+
+		// The host may send again while the STM32 takes its time
+		if (rx_held && sizeof(rx_ring) - 1 - rx_used() >= RX_UNHOLD_LEVEL) {
+			rx_held = 0;
+			espconn_recv_unhold(main_client);
+			os_printf("rx:unhold\r\n");
+		}
+		if (data_held && sizeof(data_ring) - 1 - data_used() >= RX_UNHOLD_LEVEL) {
+			data_held = 0;
+			if (data_client != NULL) {
+				espconn_recv_unhold(data_client);
+			}
+			os_printf("data:unhold\r\n");
+		}
+
+		spi_state = SPI_REQUESTED;
+		gpio_output_set(MREQ, 0, 0, 0);
 	}
-	return result;
+
+	if (spi_state == SPI_REQUESTED) {
+		if (!(GPIO_REG_READ(GPIO_IN_ADDRESS) & SREQ)) {
+			return;
+		}
+		for (i = 0; i < burst_frames; i++) {
+			spi_transaction(burst_buffer + i * FRAME_SIZE, FRAME_SIZE);
+		}
+		spi_state = SPI_RELEASED;
+		gpio_output_set(0, MREQ, 0, 0);
+	}
+
+	if (spi_state == SPI_RELEASED) {
+		if (GPIO_REG_READ(GPIO_IN_ADDRESS) & SREQ) {
+			return;
+		}
+		spi_state = SPI_DONE;
+	}
+
+	for (i = 0, frame = burst_buffer; i < burst_frames; i++, frame += FRAME_SIZE) {
+		if (frame[0]) {
+			for (k = 1; k < FRAME_SIZE; k++) {
+				tx_ring[tx_wi] = frame[k];
+				tx_wi = (tx_wi + 1) & (sizeof(tx_ring) - 1);
+			}
+		}
+	}
+	stm32_pending = main_client != NULL && burst_buffer[(burst_frames - 1) * FRAME_SIZE] != 0;
+	spi_state = SPI_IDLE;
+	tx_flush(0);
+	// Next burst, after whatever else is queued
+	pump_post();
 }
 
-int
-abs(int x)
+void
+gpio_intr(void *arg)
 {
-	return x < 0 ? -x : x;
+	uint32 status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+
+	GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, status);
+	if (status & SREQ) {
+		// The STM32 may raise SREQ again soon after a burst, catch it low here
+		if (spi_state == SPI_RELEASED && !(GPIO_REG_READ(GPIO_IN_ADDRESS) & SREQ)) {
+			spi_state = SPI_DONE;
+		}
+		pump_post();
+	}
 }
 
 void
 main_recv_cb(void *arg, char *data, unsigned short length)
 {
-	struct espconn *conn = arg;
-	sint8 result;
-
 	if (data == NULL) {
 		return;
 	}
 
+	if (length > sizeof(rx_ring) - 1 - rx_used()) {
+		// Not with RX_HOLD_LEVEL at least a TCP window. The rest of the
+		// stream would be garbled, so keep what fits and drop the connection.
+		os_printf("rx:overflow\r\n");
+		length = sizeof(rx_ring) - 1 - rx_used();
+		rx_overflow = 1;
+	}
 	while (length--) {
-		main_buffer[main_rx_wi++] = *data++;
-		main_rx_wi &= sizeof(main_buffer) - 1;
-		if (abs(main_rx_wi - main_rx_ri) >= 64) {
-			spi_txrx(main_buffer + main_rx_ri);
-			main_rx_ri = (main_rx_ri + 64) & (sizeof(main_buffer) - 1);
-			//os_printf("rx:%d\r\n", main_rx_ri);
-			if (!tx_blocked) {
-				if (comm_main(conn) < 0) {
-					tx_blocked = 1;
-					espconn_recv_hold(conn);
-					os_printf("tx:block\r\n");
-				}
-			}
-		}
+		rx_ring[rx_wi] = *data++;
+		rx_wi = (rx_wi + 1) & (sizeof(rx_ring) - 1);
 	}
+	if (!rx_held && sizeof(rx_ring) - 1 - rx_used() < RX_HOLD_LEVEL) {
+		rx_held = 1;
+		espconn_recv_hold(main_client);
+		os_printf("rx:hold\r\n");
+	}
+	pump_post();
 }
 
 void ICACHE_FLASH_ATTR
 main_sent_cb(void *arg)
 {
-	struct espconn *conn = arg;
-
-	if (comm_main(conn) == 0 && main_rx_ri == main_tx_i && tx_blocked) {
-		tx_blocked = 0;
-		espconn_recv_unhold(conn);
-		os_printf("tx:unblock\r\n");
-	}
+	tx_flush(0);
+	pump_post();
 }
 
 void ICACHE_FLASH_ATTR
@@ -189,6 +412,12 @@ main_disconnect_cb(void *arg)
 {
 	struct espconn *conn = arg;
 
+	main_client = NULL;
+	rx_held = 0;
+	stm32_pending = 0;
+	os_timer_disarm(&tx_flush_timer);
+	tx_flush_armed = 0;
+
 	os_printf("MAIN disconnect %d.%d.%d.%d:%d\r\n", conn->proto.tcp->remote_ip[0],
 			conn->proto.tcp->remote_ip[1], conn->proto.tcp->remote_ip[2],
 			conn->proto.tcp->remote_ip[3], conn->proto.tcp->remote_port);
@@ -199,10 +428,18 @@ main_connect_cb(void *arg)
 {
 	struct espconn *conn = arg;
 
-	main_rx_ri = 0;
-	main_rx_wi = 0;
-	main_tx_i = 0;
-	tx_blocked = 0;
+	rx_ri = 0;
+	rx_wi = 0;
+	rx_held = 0;
+	rx_overflow = 0;
+	tx_ri = 0;
+	tx_wi = 0;
+	stm32_pending = 1;
+	main_client = conn;
+	os_timer_disarm(&tx_flush_timer);
+	tx_flush_armed = 0;
+	os_timer_setfn(&tx_flush_timer, tx_flush_timer_cb, NULL);
+	pump_post();
 
 	espconn_regist_recvcb(conn, main_recv_cb);
 	espconn_regist_sentcb(conn, main_sent_cb);
@@ -213,6 +450,67 @@ main_connect_cb(void *arg)
 			conn->proto.tcp->remote_ip[3], conn->proto.tcp->remote_port);
 }
 
+void
+data_recv_cb(void *arg, char *data, unsigned short length)
+{
+	if (data == NULL) {
+		return;
+	}
+
+	if (length > sizeof(data_ring) - 1 - data_used()) {
+		// Not with RX_HOLD_LEVEL at least a TCP window. The rest of the
+		// stream would be garbled, so keep what fits and drop the connection.
+		os_printf("data:overflow\r\n");
+		length = sizeof(data_ring) - 1 - data_used();
+		data_overflow = 1;
+	}
+	while (length--) {
+		data_ring[data_wi] = *data++;
+		data_wi = (data_wi + 1) & (sizeof(data_ring) - 1);
+	}
+	if (!data_held && sizeof(data_ring) - 1 - data_used() < RX_HOLD_LEVEL) {
+		data_held = 1;
+		espconn_recv_hold(data_client);
+		os_printf("data:hold\r\n");
+	}
+	pump_post();
+}
+
+void ICACHE_FLASH_ATTR
+data_disconnect_cb(void *arg)
+{
+	struct espconn *conn = arg;
+
+	// Whatever is left in data_ring still goes to the STM32
+	data_client = NULL;
+
+	os_printf("DATA disconnect %d.%d.%d.%d:%d\r\n", conn->proto.tcp->remote_ip[0],
+			conn->proto.tcp->remote_ip[1], conn->proto.tcp->remote_ip[2],
+			conn->proto.tcp->remote_ip[3], conn->proto.tcp->remote_port);
+}
+
+// A new data connection aborts the uploads of the previous one
+void ICACHE_FLASH_ATTR
+data_connect_cb(void *arg)
+{
+	struct espconn *conn = arg;
+
+	data_ri = 0;
+	data_wi = 0;
+	data_held = 0;
+	data_overflow = 0;
+	data_reset = 1;
+	data_client = conn;
+
+	espconn_regist_recvcb(conn, data_recv_cb);
+	espconn_regist_disconcb(conn, data_disconnect_cb);
+
+	os_printf("DATA connect %d.%d.%d.%d:%d\r\n", conn->proto.tcp->remote_ip[0],
+			conn->proto.tcp->remote_ip[1], conn->proto.tcp->remote_ip[2],
+			conn->proto.tcp->remote_ip[3], conn->proto.tcp->remote_port);
+	pump_post();
+}
+
 void ICACHE_FLASH_ATTR
 user_init()
 {
@@ -233,10 +531,11 @@ user_init()
 	for (i = 0; i < sizeof(buffer); i++) {
 		buffer[i] = 0;
 	}
-	buffer[0] = 0xc0;	// END
-	buffer[1] = 0x80;	// SETUP_WIFI
-	buffer[2] = 0xc0;	// END
-	buffer[3] = 0x00;	// NOP
+	buffer[0] = 4;		// payload length
+	buffer[1] = 0xc0;	// END
+	buffer[2] = 0x80;	// SETUP_WIFI
+	buffer[3] = 0xc0;	// END
+	buffer[4] = 0x00;	// NOP
 	spi_txrx(buffer);
 	buffer[0] = 0x00;
 	buffer[1] = 0x00;
@@ -246,6 +545,13 @@ user_init()
 
 	os_printf("SSID: %s, passwd: %s\r\n", wp->ssid, wp->password);
 
+	// From here on bursts are run by pump_task
+	system_os_task(pump_task, PUMP_TASK_PRIO, pump_queue, PUMP_QUEUE_LEN);
+	ETS_GPIO_INTR_DISABLE();
+	ETS_GPIO_INTR_ATTACH(gpio_intr, NULL);
+	gpio_pin_intr_state_set(GPIO_ID_PIN(5), GPIO_PIN_INTR_ANYEDGE);
+	ETS_GPIO_INTR_ENABLE();
+
 	wifi_set_opmode(SOFTAP_MODE);
 	bzero(&config, sizeof(config));
 	strcpy(config.ssid, wp->ssid);
@@ -267,6 +573,16 @@ user_init()
 	i = espconn_accept(&main_conn);
 	os_printf("MAIN accept %d\r\n", i);
 
+	bzero(&data_conn, sizeof(struct espconn));
+	bzero(&data_tcp, sizeof(esp_tcp));
+	data_tcp.local_port = DATA_PORT;
+	data_conn.type = ESPCONN_TCP;
+	data_conn.state = ESPCONN_NONE;
+	data_conn.proto.tcp = &data_tcp;
+	espconn_regist_connectcb(&data_conn, data_connect_cb);
+	i = espconn_accept(&data_conn);
+	os_printf("DATA accept %d\r\n", i);
+
 	bzero(aux_buffer, sizeof(aux_buffer));
 
 	bzero(&aux_conn, sizeof(struct espconn));